@@ -1,6 +1,7 @@
 #ifndef ARENA_H
 #define ARENA_H
 
+#include <string.h>
 #include <sys/mman.h>
 
 #include <stdint.h>
@@ -14,33 +15,55 @@ typedef int32_t A_s32;
 typedef int64_t A_s64;
 typedef A_u32 A_b32;
 
+// Memory is committed in steps of this size as the arena grows, must be a multiple of the page
+// size
+#define ARENA_COMMIT_SIZE (64 * 1024)
+// Committed memory past the position that is given back to the system when popping
+#define ARENA_DECOMMIT_THRESHOLD (1024 * 1024)
+
 // Arena Allocator
+// ArenaAlloc() only reserves address space, memory is committed when it is pushed onto so an
+// arena can be given a size far larger than what it will usually need.
 typedef struct {
     void* addr;
-    A_u64 size;
+    A_u64 size;      // reserved bytes
     A_u64 pos;
+    A_u64 committed; // bytes from addr that can be used
 } Arena;
-#define PushArray(arena, type, count) (type*)ArenaPush((arena), sizeof(type) * (count))
-#define PushArrayZero(arena, type, count) (type*)ArenaPushZero((arena), sizeof(type) * (count))
-#define PushStruct(arena, type) PushArray((arena), (type), 1)
-#define PushStructZero(arena, type) PushArrayZero((arena), (type), 1)
+
+// Position in arena to go back to, see ArenaTempBegin()
+typedef struct {
+    Arena* arena;
+    A_u64 pos;
+} ArenaTemp;
+
+#define PushArray(arena, type, count) (type*)ArenaPushAligned((arena), sizeof(type) * (count), _Alignof(type))
+#define PushArrayZero(arena, type, count) (type*)memset(PushArray((arena), type, (count)), 0, sizeof(type) * (count))
+#define PushStruct(arena, type) PushArray((arena), type, 1)
+#define PushStructZero(arena, type) PushArrayZero((arena), type, 1)
 
 void ArenaAlloc(Arena* arena, A_u64 size);
 void ArenaRelease(Arena* arena);
 void* ArenaPush(Arena* arena, A_u64 size);
+void* ArenaPushAligned(Arena* arena, A_u64 size, A_u64 align);
+void ArenaPopTo(Arena* arena, A_u64 pos);
+void ArenaReset(Arena* arena);
+ArenaTemp ArenaTempBegin(Arena* arena);
+void ArenaTempEnd(ArenaTemp temp);
 
 #endif // ARENA_H
 
 #ifdef ARENA_IMPL
 
-// Returns arena in case of success, or 0 if it failed to alllocate the memory
+// Reserve size bytes of address space for arena, nothing is committed yet.
 void
 ArenaAlloc(Arena* arena, A_u64 size)
 {
-    arena->addr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    arena->addr = mmap(0, size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
     Assert(arena->addr != MAP_FAILED);
     arena->pos = 0;
     arena->size = size;
+    arena->committed = 0;
 }
 
 void
@@ -49,6 +72,8 @@ ArenaRelease(Arena* arena)
     munmap(arena->addr, arena->size);
 }
 
+// Push size bytes right after the previous push, so consecutive pushes are contiguous.
+// Returns pointer to the pushed memory.
 void*
 ArenaPush(Arena* arena, A_u64 size)
 {
@@ -56,8 +81,68 @@ ArenaPush(Arena* arena, A_u64 size)
     mem = (A_u8*)arena->addr + arena->pos;
     arena->pos += size;
     Assert(arena->pos <= arena->size);
+
+    if (arena->pos > arena->committed)
+    {
+        A_u64 committed = (arena->pos + ARENA_COMMIT_SIZE - 1) & ~(A_u64)(ARENA_COMMIT_SIZE - 1);
+        if (committed > arena->size)
+            committed = arena->size;
+
+        A_s32 err = mprotect((A_u8*)arena->addr + arena->committed, committed - arena->committed,
+                             PROT_READ | PROT_WRITE);
+        Assert(!err);
+        arena->committed = committed;
+    }
+
     return mem;
 }
 
+// Push size bytes starting at a multiple of align, which must be a power of two.
+// Returns pointer to the pushed memory.
+void*
+ArenaPushAligned(Arena* arena, A_u64 size, A_u64 align)
+{
+    A_u64 pos = (arena->pos + align - 1) & ~(align - 1);
+    ArenaPush(arena, pos - arena->pos + size);
+    return (A_u8*)arena->addr + pos;
+}
+
+// Go back to pos, everything pushed after it is freed.  When a lot of committed memory is left
+// past pos it is given back to the system.
+void
+ArenaPopTo(Arena* arena, A_u64 pos)
+{
+    Assert(pos <= arena->pos);
+    arena->pos = pos;
+
+    A_u64 keep = (pos + ARENA_COMMIT_SIZE - 1) & ~(A_u64)(ARENA_COMMIT_SIZE - 1);
+    if (arena->committed < keep + ARENA_DECOMMIT_THRESHOLD) return;
+
+    A_u8* addr = (A_u8*)arena->addr + keep;
+    madvise(addr, arena->committed - keep, MADV_DONTNEED);
+    mprotect(addr, arena->committed - keep, PROT_NONE);
+    arena->committed = keep;
+}
+
+void
+ArenaReset(Arena* arena)
+{
+    ArenaPopTo(arena, 0);
+}
+
+// Remember arena's position so temporary allocations can be freed with ArenaTempEnd().
+ArenaTemp
+ArenaTempBegin(Arena* arena)
+{
+    ArenaTemp temp = {arena, arena->pos};
+    return temp;
+}
+
+void
+ArenaTempEnd(ArenaTemp temp)
+{
+    ArenaPopTo(temp.arena, temp.pos);
+}
+
 #undef ARENA_IMPL
 #endif // ARENA_IMPL
@@ -5,17 +5,29 @@
 
 #include <arpa/inet.h>
 #include <locale.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
-#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 
 #define TIMEOUT_POLL 60 * 1000
-// time to reconnect in seconds
-#define TIMEOUT_RECONNECT 1
+// Delays in milliseconds between reconnection attempts, doubled after each failed attempt
+// until RECONNECT_CAP.  The actual delay is chosen at random below this value.
+#define RECONNECT_BASE 250
+#define RECONNECT_CAP 30 * 1000
+// Time in milliseconds to wait for the server during authentication
+#define TIMEOUT_HANDSHAKE 5 * 1000
+// Time in milliseconds between acknowledging received notifications
+#define ACK_INTERVAL 1000
+// Time in milliseconds sent data may stay unacknowledged before the connection to the server
+// fails
+#define SEND_TIMEOUT (HEARTBEAT_INTERVAL * HEARTBEAT_MISSED)
 #define MAX_INPUT_LEN 512
 // Filepath where user ID is stored
 #define ID_FILE ".chatty_id"
+// Filepath where old messages are cached
+#define CACHE_FILE ".chatty_cache"
 // Filepath where logged
 #define LOGFILE "chatty.log"
 // enable logging
@@ -48,8 +60,8 @@ raise(SIGTRAP); \
 #define UI_IMPL
 #include "ui.h"
 
-enum { FDS_BI = 0, // for one-way communication with the server (eg. TextMessage)
-    FDS_UNI,      // For two-way communication with the server (eg. IDMessage)
+enum { FDS_SERVER = 0, // Connection to the server, see "Requests" in protocol.h
+    FDS_CONNECT,          // Connection to the server still being established
     FDS_TTY,
     FDS_RESIZE,
     FDS_MAX };
@@ -68,9 +80,41 @@ typedef struct {
 
 // User used by chatty
 global_variable User user = {0};
+// Session used for resuming after losing the connection, see "Sessions" in protocol.h
+// Seq is the sequence number of the last received notification.
+typedef struct {
+    u64 Token;
+    u64 Seq;
+    u64 Acked;   // Seq sent in the last AckMessage, see send_ack()
+    u64 AckTime; // Time in milliseconds of the last AckMessage
+    u32 Missing; // Waiting for missed notifications to be sent again
+} session;
+global_variable session Session = {0};
+// Detecting a dead connection to the server, see "Heartbeats" in protocol.h
+typedef struct {
+    u64 LastRecv; // Time in milliseconds something was last received from the server
+    u32 Missed;   // Pings sent since then
+} heartbeat;
+global_variable heartbeat Heartbeat = {0};
 // Address of chatty server
 global_variable struct sockaddr_in address;
 
+// Reconnecting to the server after the connection was lost, see reconnect_schedule()
+typedef struct {
+    u32 Attempt;    // Failed attempts since the connection was lost
+    u64 NextTry;    // Time in milliseconds of the next attempt, 0 if none is scheduled
+    u32 RetryAfter; // Minimum delay asked for by the server, 0 if none
+} reconnect;
+global_variable reconnect Reconnect = {0};
+
+// Room the user is sending messages to, see "Rooms" in protocol.h
+typedef struct {
+    RoomID Current; // 0 is the room everyone is in
+    RoomID Pending; // Room the user asked to join, becomes Current once the server accepts
+    u32 Request;    // Request number of the pending join, 0 if none
+} room_state;
+global_variable room_state Rooms = {0};
+
 // fill str array with char
 void
 fillstr(u32* Str, u32 ch, u32 Len)
@@ -88,49 +132,183 @@ popup(u32 fg, u32 bg, u8* text)
     tb_print(global.width / 2 - len / 2, global.height / 2, fg, bg, (char*)text);
 }
 
-// Returns client in clientsArena matching id
+// Known users.  Each User is stored once in the Users arena, Slots is an open addressing hash
+// table that maps an ID to the index of its User plus one, so that 0 means an empty slot.
+// The table is kept at most half full.
+#define USERS_MAP_SIZE 65536
+#define USERS_MAX (USERS_MAP_SIZE / 2)
+typedef struct {
+    Arena Users;
+    ID Keys[USERS_MAP_SIZE];
+    u32 Slots[USERS_MAP_SIZE];
+} user_cache;
+
+// Returns slot index where id is or should be inserted in Cache
+u32
+user_cache_slot(user_cache* Cache, ID id)
+{
+    // Fibonacci hashing, ids are sequential so spread them over the table
+    u32 Slot = (u32)((id * 11400714819323198485llu) >> 48) & (USERS_MAP_SIZE - 1);
+    while (Cache->Slots[Slot] && Cache->Keys[Slot] != id)
+        Slot = (Slot + 1) & (USERS_MAP_SIZE - 1);
+    return Slot;
+}
+
+// Returns client in Cache matching id
 // Returns user if the id was the user's ID
 // Returns 0 if nothing was found
 User*
-get_user_by_id(Arena* clientsArena, ID id)
+get_user_by_id(user_cache* Cache, ID id)
 {
-    // User is not in the clientsArena
+    // User is not in the cache
     if (id == user.ID) return &user;
     
-    User* clients = clientsArena->addr;
-    for (u64 i = 0; i < (clientsArena->pos / sizeof(*clients)); i++)
+    u32 Slot = user_cache_slot(Cache, id);
+    if (!Cache->Slots[Slot]) return 0;
+    
+    return (User*)Cache->Users.addr + Cache->Slots[Slot] - 1;
+}
+
+// Returns user in Cache whose author is Name
+// Returns 0 if nothing was found
+User*
+get_user_by_name(user_cache* Cache, u8* Name)
+{
+    if (!strcmp((char*)user.Author, (char*)Name)) return &user;
+    
+    User* Users = Cache->Users.addr;
+    u32 Count = Cache->Users.pos / sizeof(*Users);
+    for (u32 i = 0; i < Count; i++)
     {
-        if (clients[i].ID == id)
-            return clients + i;
+        if (!strcmp((char*)Users[i].Author, (char*)Name))
+            return Users + i;
     }
     return 0;
 }
 
-// Request information of client from fd byd id and add it to clientsArena
-// Returns pointer to added client
-User*
-add_user_info(Arena* clientsArena, s32 fd, u64 id)
+// Lookups for users that are not in the user cache yet.  IDs are collected while drawing and
+// requested from the server in one IDListMessage after the frame, replies are handled in the main
+// loop.
+// IDs in [0, Sent) have been requested, IDs in [Sent, Len) are waiting to be requested.
+#define LOOKUPS_MAX 64
+typedef struct {
+    ID IDs[LOOKUPS_MAX];
+    u32 Len;
+    u32 Sent;
+} user_lookups;
+
+// Shown as author while the user's information has not been received yet.
+global_variable User PlaceholderUser = {"...", 0};
+// Shown as author when the server does not know the user.
+#define UNKNOWN_AUTHOR "?"
+
+// Add id to Lookups if it is not already pending.  When the table is full the id is dropped, it
+// will be added again on the next frame.
+void
+request_user_info(user_lookups* Lookups, ID id)
 {
-    // Request information about ID
-    HeaderMessage header = HEADER_INIT(HEADER_TYPE_ID);
-    header.id = user.ID;
-    IDMessage message = {id};
-    s32 nsend = sendAnyMessage(fd, header, &message);
-    Assert(nsend != -1);
+    for (u32 i = 0; i < Lookups->Len; i++)
+    {
+        if (Lookups->IDs[i] == id)
+            return;
+    }
+    if (Lookups->Len == LOOKUPS_MAX)
+        return;
     
-    // Wait for response
-    IntroductionMessage introduction_message;
-    recvAnyMessageType(fd, &header, &introduction_message, HEADER_TYPE_INTRODUCTION);
+    Lookups->IDs[Lookups->Len++] = id;
+}
+
+// Last request number used, see "Requests" in protocol.h
+global_variable u32 LastRequest = 0;
+
+// Returns a new non-zero request number
+u32
+new_request(void)
+{
+    LastRequest++;
+    if (!LastRequest) LastRequest++;
+    return LastRequest;
+}
+
+// Send all ids in Lookups that were not yet requested to fd, in IDListMessages of at most
+// IDLIST_MAX ids.
+void
+send_user_lookups(user_lookups* Lookups, s32 fd)
+{
+    if (fd == -1) return;
     
-    // Add the information
-    User* client = ArenaPush(clientsArena, sizeof(*client));
-    memcpy(client->Author, introduction_message.author, AUTHOR_LEN);
+    while (Lookups->Sent < Lookups->Len)
+    {
+        HeaderMessage header = HEADER_INIT(HEADER_TYPE_IDLIST);
+        header.id = user.ID;
+        header.request = new_request();
+        IDListMessage message = {0};
+        while (Lookups->Sent < Lookups->Len && message.len < IDLIST_MAX)
+            message.ids[message.len++] = Lookups->IDs[Lookups->Sent++];
+        
+        s32 nsend = sendAnyMessage(fd, header, &message);
+        Assert(nsend != -1);
+        LoggingF("Requested %d user(s)\n", message.len);
+    }
+}
+
+// Remove id from requested ids in Lookups
+void
+remove_user_lookup(user_lookups* Lookups, ID id)
+{
+    for (u32 i = 0; i < Lookups->Sent; i++)
+    {
+        if (Lookups->IDs[i] != id) continue;
+        
+        // Keep requested ids before the waiting ones
+        Lookups->IDs[i] = Lookups->IDs[Lookups->Sent - 1];
+        Lookups->IDs[Lookups->Sent - 1] = Lookups->IDs[Lookups->Len - 1];
+        Lookups->Sent--;
+        Lookups->Len--;
+        return;
+    }
+}
+
+// Add user with id and author to Cache and remove it from Lookups.
+// Returns pointer to added client, 0 if Cache is full
+User*
+add_user_info(user_cache* Cache, user_lookups* Lookups, ID id, u8* author)
+{
+    u32 Slot = user_cache_slot(Cache, id);
+    Assert(!Cache->Slots[Slot]);
+    if (Cache->Users.pos == USERS_MAX * sizeof(User)) return 0;
+    
+    User* client = PushStruct(&Cache->Users, User);
+    memcpy(client->Author, author, AUTHOR_LEN);
+    client->Author[AUTHOR_LEN - 1] = 0;
     client->ID = id;
     
+    Cache->Keys[Slot] = id;
+    Cache->Slots[Slot] = Cache->Users.pos / sizeof(*client);
+    
+    remove_user_lookup(Lookups, id);
+    
     LoggingF("Got " USER_FMT "\n", USER_ARG((*client)));
     return client;
 }
 
+// Returns the time in milliseconds of the monotonic clock
+u64
+get_time_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (u64)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+// Make a send to a server that vanished fail after SEND_TIMEOUT instead of queueing up.
+void
+set_send_timeout(s32 fd)
+{
+    u32 Timeout = SEND_TIMEOUT;
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &Timeout, sizeof(Timeout));
+}
+
 // Tries to connect to address and populates resulting file descriptors in ConnectionResult.
 s32
 get_connection(struct sockaddr_in* address)
@@ -139,11 +317,65 @@ get_connection(struct sockaddr_in* address)
     if (fd == -1) return -1;
     
     s32 err = connect(fd, (struct sockaddr*)address, sizeof(*address));
-    if (err) return -1;
+    if (err)
+    {
+        close(fd);
+        return -1;
+    }
+    set_send_timeout(fd);
     
     return fd;
 }
 
+// Receive the answer of type on fd.  When the server answers with an error instead its retry
+// hint is saved in Reconnect.
+// Returns 0 if an error occurred or an unexpected answer was received.  Non-zero on success.
+u32
+recv_answer(s32 fd, HeaderMessage* header, void* message, HeaderType type)
+{
+    s32 nrecv = recv(fd, header, sizeof(*header), MSG_WAITALL);
+    if (nrecv != sizeof(*header)) return 0;
+    
+    if (header->type == HEADER_TYPE_ERROR && type != HEADER_TYPE_ERROR)
+    {
+        ErrorMessage error_message;
+        nrecv = recv(fd, &error_message, sizeof(error_message), MSG_WAITALL);
+        if (nrecv != sizeof(error_message)) return 0;
+        
+        LoggingF("Got error instead of %s: %s\n", headerTypeString(type),
+                 errorTypeString(error_message.type));
+        Reconnect.RetryAfter = error_message.retry;
+        return 0;
+    }
+    if (header->type != type) return 0;
+    
+    u32 size = getMessageSize(type);
+    nrecv = recv(fd, message, size, MSG_WAITALL);
+    if (nrecv != size) return 0;
+    
+    if (type == HEADER_TYPE_ERROR)
+        Reconnect.RetryAfter = ((ErrorMessage*)message)->retry;
+    
+    return 1;
+}
+
+// Receive the SessionMessage sent after authentication on fd and save it in Session.
+// Returns 0 if an error occurred.  Non-zero on success.
+u32
+recv_session(s32 fd)
+{
+    HeaderMessage header;
+    SessionMessage message;
+    if (!recv_answer(fd, &header, &message, HEADER_TYPE_SESSION))
+        return 0;
+    
+    Session.Token = message.token;
+    Session.Seq = message.seq;
+    Session.Acked = message.seq;
+    Session.Missing = 0;
+    return 1;
+}
+
 // Authenticates a file descriptor with either the user's id if non-zero or 
 // it's information if id is zero.
 // Returns 0 if an error occurred.  Non-zero on success.
@@ -154,19 +386,18 @@ authenticate(User* user, s32 fd)
     if (user->ID)
     {
         HeaderMessage header = HEADER_INIT(HEADER_TYPE_ID);
+        header.request = new_request();
         IDMessage message = {user->ID};
         s32 nsend = sendAnyMessage(fd, header, &message);
-        Assert(nsend != -1);
+        if (nsend == -1) return 0;
         
         ErrorMessage error_message;
-        s32 nrecv = recvAnyMessageType(fd, &header, &error_message, HEADER_TYPE_ERROR);
-        Assert(nrecv != -1);
         // TODO: handle not found
-        if (nrecv == 0)
+        if (!recv_answer(fd, &header, &error_message, HEADER_TYPE_ERROR))
             return 0;
         
         if (error_message.type == ERROR_TYPE_SUCCESS)
-            return 1;
+            return recv_session(fd);
         else
             return 0;
     }
@@ -174,73 +405,305 @@ authenticate(User* user, s32 fd)
     else
     {
         HeaderMessage header = HEADER_INIT(HEADER_TYPE_INTRODUCTION);
+        header.request = new_request();
         IntroductionMessage message;
         memcpy(message.author, user->Author, AUTHOR_LEN);
         s32 nsend = sendAnyMessage(fd, header, &message);
-        Assert(nsend != -1);
+        if (nsend == -1) return 0;
         
         IDMessage id_message;
-        s32 nrecv = recvAnyMessageType(fd, &header, &id_message, HEADER_TYPE_ID);
-        Assert(nrecv != -1);
+        if (!recv_answer(fd, &header, &id_message, HEADER_TYPE_ID))
+            return 0;
         user->ID = id_message.id;
-        return 1;
+        return recv_session(fd);
     }
 }
 
-// Connect to *address_ptr of type `struct sockaddr_in*`.  If it failed wait for TIMEOUT_RECONNECT
-// seconds.
-// This function is meant to be run by a thread.
-// An offline server means fds[FDS_SERVER] is set to -1.  When online
-// it is set to with the appropriate file descriptor.
-// Returns 0.
-#define Miliseconds(s) (s*1000*1000)
-void*
-thread_reconnect(void* fds_ptr)
+// Resume Session on fd, the missed notifications will be received after.  When the server
+// no longer knows the session Session.Token is cleared.
+// Returns 0 if the session could not be resumed.  Non-zero on success.
+u32
+resume_session(User* user, s32 fd)
 {
-    s32 unifd, bifd;
-    struct pollfd* fds = fds_ptr;
-    struct timespec t = { 0, Miliseconds(300) }; // 300 miliseconds
-    LoggingF("Trying to reconnect\n");
-    while (1)
+    if (!Session.Token) return 0;
+    
+    HeaderMessage header = HEADER_INIT(HEADER_TYPE_RESUME);
+    header.request = new_request();
+    ResumeMessage message = {user->ID, Session.Token, Session.Seq};
+    s32 nsend = sendAnyMessage(fd, header, &message);
+    if (nsend == -1) return 0;
+    
+    ErrorMessage error_message;
+    if (!recv_answer(fd, &header, &error_message, HEADER_TYPE_ERROR))
+        return 0;
+    
+    LoggingF("Resume from %lu: %s\n", Session.Seq, errorTypeString(error_message.type));
+    if (error_message.type == ERROR_TYPE_NOTFOUND ||
+        error_message.type == ERROR_TYPE_EXPIRED)
+        Session.Token = 0;
+    // Everything after Session.Seq is sent again
+    Session.Missing = 0;
+    
+    return (error_message.type == ERROR_TYPE_SUCCESS);
+}
+
+// Send a RoomMessage of Type for Room on fd, a join becomes effective once the server answers.
+void
+send_room_request(s32 fd, RoomType Type, RoomID Room)
+{
+    HeaderMessage header = HEADER_INIT(HEADER_TYPE_ROOM);
+    header.request = new_request();
+    header.id = user.ID;
+    RoomMessage message = {.type = Type, .room = Room};
+    s32 nsend = sendAnyMessage(fd, header, &message);
+    if (nsend == -1) return;
+    
+    if (Type == ROOM_TYPE_JOIN)
     {
-        // timeout
-        nanosleep(&t, &t);
-        
-        bifd = get_connection(&address);
-        if (bifd == -1)
-        {
-            LoggingF("errno: %d\n", errno);
-            continue;
-        }
-        unifd = get_connection(&address);
-        if (unifd == -1)
-        {
-            LoggingF("errno: %d\n", errno);
-            close(bifd);
-            continue;
-        }
-        
-        LoggingF("Reconnect succeeded (%d, %d), authenticating\n", unifd, bifd);
-        
-        if (authenticate(&user, bifd) &&
-            authenticate(&user, unifd))
-        {
-            break;
-        }
-        
-        close(bifd);
-        close(unifd);
-        
-        LoggingF("Failed, retrying...\n");
+        Rooms.Pending = Room;
+        Rooms.Request = header.request;
     }
+}
+
+// Acknowledge the notifications received up to Session.Seq on fd.  With ACK_TYPE_MISSING the
+// server sends the ones after it again.  See "Acknowledgements" in protocol.h.
+void
+send_ack(s32 fd, AckType Type)
+{
+    HeaderMessage header = HEADER_INIT(HEADER_TYPE_ACK);
+    header.id = user.ID;
+    AckMessage message = {.type = Type, .seq = Session.Seq};
+    s32 nsend = sendAnyMessage(fd, header, &message);
+    if (nsend == -1) return;
     
-    fds[FDS_BI].fd = bifd;
-    fds[FDS_UNI].fd = unifd;
+    Session.Acked = Session.Seq;
+    Session.AckTime = get_time_ms();
+    if (Type == ACK_TYPE_MISSING)
+        Session.Missing = 1;
+}
+
+// Returns time in milliseconds until the next acknowledgement is due, or Timeout if there is
+// nothing to acknowledge or Timeout is sooner.
+s32
+ack_timeout(s32 Timeout)
+{
+    if (Session.Acked == Session.Seq) return Timeout;
     
-    // Redraw screen
-    raise(SIGWINCH);
+    u64 Now = get_time_ms();
+    if (Session.AckTime + ACK_INTERVAL <= Now) return 0;
     
-    return 0;
+    u64 Wait = Session.AckTime + ACK_INTERVAL - Now;
+    return (Wait < (u64)Timeout) ? (s32)Wait : Timeout;
+}
+
+// Note that something was received from the server.
+void
+heartbeat_reset(void)
+{
+    Heartbeat.LastRecv = get_time_ms();
+    Heartbeat.Missed = 0;
+}
+
+// Returns time in milliseconds until the next ping is due, or Timeout if it is sooner.
+s32
+heartbeat_timeout(s32 Timeout)
+{
+    u64 Due = Heartbeat.LastRecv + (u64)HEARTBEAT_INTERVAL * (Heartbeat.Missed + 1);
+    u64 Now = get_time_ms();
+    if (Due <= Now) return 0;
+    
+    u64 Wait = Due - Now;
+    return (Wait < (u64)Timeout) ? (s32)Wait : Timeout;
+}
+
+// Send a PingMessage or, when answering one, a PongMessage with message's timestamp on fd.
+void
+send_ping(s32 fd, HeaderType Type, PingMessage* message)
+{
+    HeaderMessage header = HEADER_INIT(Type);
+    header.id = user.ID;
+    sendAnyMessage(fd, header, message);
+    
+    // A failed send counts as missed too, the connection is given up on after enough of them
+    if (Type == HEADER_TYPE_PING)
+        Heartbeat.Missed++;
+}
+
+// Receive the message following header on fd and forget it.
+void
+discard_message(Arena* ScratchArena, s32 fd, HeaderMessage* header)
+{
+    ArenaTemp Temp = ArenaTempBegin(ScratchArena);
+    if (header->type == HEADER_TYPE_TEXT)
+        recvTextMessage(ScratchArena, fd);
+    else
+    {
+        u32 Size = getMessageSize(header->type);
+        void* addr = ArenaPush(ScratchArena, Size);
+        s32 nrecv = recv(fd, addr, Size, MSG_WAITALL);
+        Assert(nrecv == (s32)Size);
+    }
+    ArenaTempEnd(Temp);
+}
+
+// Update Session for the notification with header received on fd.  When notifications before it
+// were lost they are asked for again, see "Acknowledgements" in protocol.h.
+// Returns 0 if the notification must be ignored until the missing ones were received.
+u32
+accept_notification(s32 fd, HeaderMessage* header)
+{
+    // Missed messages sent after authenticating are older than the session
+    if (header->seq <= Session.Seq) return 1;
+    
+    if (header->prev > Session.Seq)
+    {
+        LoggingF("Missing %lu-%lu\n", Session.Seq + 1, header->prev);
+        if (!Session.Missing)
+            send_ack(fd, ACK_TYPE_MISSING);
+        return 0;
+    }
+    Session.Seq = header->seq;
+    Session.Missing = 0;
+    return 1;
+}
+
+// Schedule the next attempt to reconnect in Reconnect.  The delay is chosen at random up to
+// an exponentially growing limit so that clients disconnected at the same time do not
+// reconnect all at once, but never less than what the server asked for.
+void
+reconnect_schedule(reconnect* Reconnect)
+{
+    u32 Shift = (Reconnect->Attempt < 16) ? Reconnect->Attempt : 16;
+    u64 Limit = (u64)RECONNECT_BASE << Shift;
+    if (Limit > RECONNECT_CAP) Limit = RECONNECT_CAP;
+    
+    u64 Delay = (u64)rand() % (Limit + 1);
+    if (Delay < Reconnect->RetryAfter)
+        Delay = Reconnect->RetryAfter;
+    
+    Reconnect->RetryAfter = 0;
+    Reconnect->Attempt++;
+    Reconnect->NextTry = get_time_ms() + Delay;
+    LoggingF("Reconnecting in %lums (attempt %u)\n", Delay, Reconnect->Attempt);
+}
+
+// Returns the timeout in milliseconds for poll() until the next reconnection attempt is due,
+// or Timeout if it is sooner.
+s32
+reconnect_timeout(reconnect* Reconnect, s32 Timeout)
+{
+    if (!Reconnect->NextTry) return Timeout;
+    
+    u64 Now = get_time_ms();
+    if (Reconnect->NextTry <= Now) return 0;
+    
+    u64 Wait = Reconnect->NextTry - Now;
+    return (Wait < (u64)Timeout) ? (s32)Wait : Timeout;
+}
+
+// Finish connecting on fd by resuming the session, or authenticating when that is not
+// possible.  On success fds[FDS_SERVER] is set to fd, otherwise fd is closed and a new attempt
+// is scheduled.
+void
+reconnect_finish(reconnect* Reconnect, struct pollfd* fds, s32 fd)
+{
+    // Back to blocking for the handshake, but do not wait forever on an unresponsive server
+    s32 flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    struct timeval Timeout = {TIMEOUT_HANDSHAKE / 1000, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+    
+    u32 HadSession = (Session.Token != 0);
+    u32 Resumed = resume_session(&user, fd);
+    u32 Connected = (Resumed || (!HadSession && authenticate(&user, fd)));
+    
+    if (!Connected)
+    {
+        close(fd);
+        // The session is gone, authenticate on a new connection right away
+        if (HadSession && !Session.Token)
+            Reconnect->NextTry = get_time_ms();
+        else
+            reconnect_schedule(Reconnect);
+        return;
+    }
+    
+    Timeout = (struct timeval){0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+    
+    LoggingF("Reconnected (%d)\n", fd);
+    set_send_timeout(fd);
+    fds[FDS_SERVER].fd = fd;
+    heartbeat_reset();
+    *Reconnect = (reconnect){0};
+    
+    // A new session does not know about the joined room
+    if (!Resumed && Rooms.Current)
+        send_room_request(fd, ROOM_TYPE_JOIN, Rooms.Current);
+}
+
+// Start a non-blocking connection to address, the attempt continues when fds[FDS_CONNECT]
+// becomes writable.
+void
+reconnect_start(reconnect* Reconnect, struct pollfd* fds)
+{
+    Reconnect->NextTry = 0;
+    
+    s32 fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1)
+    {
+        reconnect_schedule(Reconnect);
+        return;
+    }
+    
+    s32 err = connect(fd, (struct sockaddr*)&address, sizeof(address));
+    if (!err)
+    {
+        reconnect_finish(Reconnect, fds, fd);
+    }
+    else if (errno == EINPROGRESS)
+    {
+        fds[FDS_CONNECT].fd = fd;
+    }
+    else
+    {
+        LoggingF("errno: %d\n", errno);
+        close(fd);
+        reconnect_schedule(Reconnect);
+    }
+}
+
+// Handle the pending connection in fds[FDS_CONNECT] becoming writable.
+void
+reconnect_connected(reconnect* Reconnect, struct pollfd* fds)
+{
+    s32 fd = fds[FDS_CONNECT].fd;
+    fds[FDS_CONNECT].fd = -1;
+    
+    s32 error = 0;
+    socklen_t len = sizeof(error);
+    s32 err = getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (err || error)
+    {
+        LoggingF("errno: %d\n", err ? errno : error);
+        close(fd);
+        reconnect_schedule(Reconnect);
+        return;
+    }
+    
+    reconnect_finish(Reconnect, fds, fd);
+}
+
+// Close the connection to the server in fds[FDS_SERVER] and schedule reconnecting.
+void
+server_lost(struct pollfd* fds, user_lookups* Lookups)
+{
+    s32 err = close(fds[FDS_SERVER].fd);
+    Assert(err == 0);
+    fds[FDS_SERVER].fd = -1; // ignore
+    // requests in flight are lost, send them again after reconnecting
+    Lookups->Sent = 0;
+    reconnect_schedule(&Reconnect);
 }
 
 command_output
@@ -294,13 +757,252 @@ run_command_get_output(char *Command, char *Argv[], u8 *OutputBuffer, int Len)
     return Result;
 }
 
+// Messages are appended to a log as a header followed by the message.  The newest part of the
+// log is kept in the Recent arena, when it is full its contents are appended to the cache file
+// so that memory usage stays the same no matter how many messages were received.  Messages in
+// the cache file are read through a mapped window that is moved when needed.
+// Recent contains the log starting at offset Spilled.
+#define STORE_RECENT_SIZE Megabytes(8)
+#define STORE_WINDOW_SIZE Megabytes(1)
+// Messages start at a multiple of this so their fields are aligned
+#define STORE_ALIGN 8
+// Largest possible message in the log
+#define MESSAGE_MAX_SIZE (sizeof(HeaderMessage) + TEXTMESSAGE_SIZE + 0xFFFF * sizeof(wchar_t))
+typedef struct {
+    Arena Recent;
+    s32 CacheFD;
+    u64 Spilled;
+    u8* Window;
+    u64 WindowStart;
+} message_store;
+
+void
+store_init(message_store* Store)
+{
+    ArenaAlloc(&Store->Recent, STORE_RECENT_SIZE);
+    Store->CacheFD = open(CACHE_FILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    Assert(Store->CacheFD != -1);
+    // Only needed while running
+    unlink(CACHE_FILE);
+    Store->Spilled = 0;
+    Store->Window = 0;
+    Store->WindowStart = 0;
+}
+
+// Returns offset in the log where the next message will be stored
+u64
+store_offset(message_store* Store)
+{
+    return Store->Spilled + Store->Recent.pos;
+}
+
+// Make sure that the next message fits in Store->Recent by moving Store->Recent to the cache file
+// if needed.  Must be called before pushing a message, so that messages are never split between
+// the cache file and memory.
+void
+store_reserve(message_store* Store)
+{
+    ArenaPushAligned(&Store->Recent, 0, STORE_ALIGN);
+    if (Store->Recent.pos + MESSAGE_MAX_SIZE <= Store->Recent.size) return;
+    
+    u8* Data = Store->Recent.addr;
+    u64 Size = Store->Recent.pos;
+    while (Size)
+    {
+        s64 nwrite = pwrite(Store->CacheFD, Data, Size, Store->Spilled);
+        Assert(nwrite > 0);
+        Data += nwrite;
+        Size -= nwrite;
+        Store->Spilled += nwrite;
+    }
+    ArenaReset(&Store->Recent);
+    LoggingF("Spilled messages, %lu bytes cached\n", Store->Spilled);
+}
+
+// Returns pointer to the message at Offset in the log.
+// NOTE: The pointer is only valid until the next call.
+HeaderMessage*
+message_at(message_store* Store, u64 Offset)
+{
+    if (Offset >= Store->Spilled)
+        return (HeaderMessage*)((u8*)Store->Recent.addr + (Offset - Store->Spilled));
+    
+    // Map a window starting on the message's page that is big enough for any message
+    if (!Store->Window ||
+        Offset < Store->WindowStart ||
+        Offset + MESSAGE_MAX_SIZE > Store->WindowStart + STORE_WINDOW_SIZE)
+    {
+        if (Store->Window) munmap(Store->Window, STORE_WINDOW_SIZE);
+        
+        Store->WindowStart = Offset & ~(u64)(PAGESIZE - 1);
+        Store->Window = mmap(0, STORE_WINDOW_SIZE, PROT_READ, MAP_SHARED,
+                             Store->CacheFD, Store->WindowStart);
+        Assert(Store->Window != MAP_FAILED);
+    }
+    
+    return (HeaderMessage*)(Store->Window + (Offset - Store->WindowStart));
+}
+
+// Each message in the log gets an entry with its offset and the number of screen lines it takes,
+// so the visible messages can be found without walking the log.
+// LinesBefore is a prefix sum of Lines, it is recomputed when the width changes.
+typedef struct {
+    u64 Offset;
+    u32 Lines;
+    u32 LinesBefore;
+} message_entry;
+
+typedef struct {
+    Arena Entries;
+    u32 Count;
+    u32 Width;  // Width the lines were computed for, 0 if not computed yet
+    u32 Scroll; // Lines scrolled up from the newest message
+} message_index;
+
+// Scrolling amount for one mouse wheel step
+#define SCROLL_WHEEL_LINES 3
+
+// Returns number of lines needed to draw the message starting with header on a screen that is
+// Width wide.  See DisplayChat().
+u32
+message_lines(Arena* ScratchArena, HeaderMessage* header, u32 Width)
+{
+    s32 VerticalBarOffset = TIMESTAMP_LEN + AUTHOR_LEN + 2;
+    
+    switch (header->type)
+    {
+        case HEADER_TYPE_TEXT:
+        {
+            if (Width <= VerticalBarOffset + 2) return 1;
+            
+            TextMessage* message = (TextMessage*)(header + 1);
+            ArenaTemp Temp = ArenaTempBegin(ScratchArena);
+            raw_result RawText = markdown_to_raw(ScratchArena, (wchar_t*)&message->text, message->len);
+            u32 Lines = tb_wrapped_lines_count(RawText.Text, RawText.Len, Width - (VerticalBarOffset + 2));
+            ArenaTempEnd(Temp);
+            return Lines;
+        }
+        case HEADER_TYPE_HISTORY: return 0;
+        default: return 1;
+    }
+}
+
+// Add message at Offset in Store to Index.
+void
+index_message(Arena* ScratchArena, message_store* Store, message_index* Index, u64 Offset)
+{
+    message_entry* Entry = PushStruct(&Index->Entries, message_entry);
+    Entry->Offset = Offset;
+    Entry->Lines = 0;
+    Entry->LinesBefore = 0;
+    
+    if (Index->Count)
+    {
+        message_entry* Previous = Entry - 1;
+        Entry->LinesBefore = Previous->LinesBefore + Previous->Lines;
+    }
+    Index->Count++;
+    
+    // Lines are computed on the first draw
+    if (!Index->Width) return;
+    
+    HeaderMessage* header = message_at(Store, Offset);
+    Entry->Lines = message_lines(ScratchArena, header, Index->Width);
+    
+    // Keep the view on the same messages when scrolled up
+    if (Index->Scroll)
+        Index->Scroll += Entry->Lines;
+}
+
+// Receive the BatchMessage following header on fd and add its entries to Store and Index as
+// if they were received one by one.  See "Batches" in protocol.h.
+void
+recv_batch(Arena* ScratchArena, message_store* Store, message_index* Index,
+           user_cache* Users, user_lookups* Lookups, s32 fd, HeaderMessage* header)
+{
+    BatchMessage Message;
+    s32 nrecv = recv(fd, &Message, sizeof(Message), MSG_WAITALL);
+    Assert(nrecv == sizeof(Message));
+    Assert(Message.size <= BATCH_SIZE);
+    
+    ArenaTemp Temp = ArenaTempBegin(ScratchArena);
+    u8* Entries = ArenaPush(ScratchArena, Message.size);
+    nrecv = recv(fd, Entries, Message.size, MSG_WAITALL);
+    Assert(nrecv == (s32)Message.size);
+    
+    BatchReader Reader;
+    batchRead(&Reader, header, &Message, Entries);
+    u32 Count = 0;
+    while (1)
+    {
+        store_reserve(Store);
+        u64 Offset = store_offset(Store);
+        HeaderMessage* Entry = batchNext(&Reader, &Store->Recent);
+        if (!Entry) break;
+        
+        if (!accept_notification(fd, Entry))
+        {
+            ArenaPopTo(&Store->Recent, Offset - Store->Spilled);
+            continue;
+        }
+        index_message(ScratchArena, Store, Index, Offset);
+        if (Entry->type == HEADER_TYPE_PRESENCE && !get_user_by_id(Users, Entry->id))
+            add_user_info(Users, Lookups, Entry->id, ((PresenceMessage*)(Entry + 1))->author);
+        Count++;
+    }
+    LoggingF("Got batch of %u/%u message(s)\n", Count, Message.count);
+    
+    ArenaTempEnd(Temp);
+}
+
+// Own texts are stored with the request number they were sent with and sequence number 0, the
+// server does not send them back.  A text the server refused gets this sequence number instead.
+#define TEXT_REFUSED ((u64)-1)
+
+// Mark the own text in Store that was sent with Request as refused, only the messages that were
+// not spilled are searched.  See "Requests" in protocol.h.
+// Returns 1 if the text was found, 0 otherwise.
+u32
+refuse_text(message_store* Store, message_index* Index, u32 Request)
+{
+    message_entry* Entries = Index->Entries.addr;
+    for (u32 i = Index->Count; i-- > 0;)
+    {
+        if (Entries[i].Offset < Store->Spilled) break;
+        
+        HeaderMessage* header = message_at(Store, Entries[i].Offset);
+        if (header->type == HEADER_TYPE_TEXT && header->id == user.ID && header->request == Request)
+        {
+            header->seq = TEXT_REFUSED;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Recompute lines for all messages in Index for a screen Width wide
+void
+reindex_messages(Arena* ScratchArena, message_store* Store, message_index* Index, u32 Width)
+{
+    message_entry* Entries = Index->Entries.addr;
+    u32 LinesBefore = 0;
+    for (u32 i = 0; i < Index->Count; i++)
+    {
+        HeaderMessage* header = message_at(Store, Entries[i].Offset);
+        Entries[i].Lines = message_lines(ScratchArena, header, Width);
+        Entries[i].LinesBefore = LinesBefore;
+        LinesBefore += Entries[i].Lines;
+    }
+    Index->Width = Width;
+}
+
 // home screen, the first screen the user sees
 // it displays a prompt with the user input of input_len wide characters
 // and the received messages from msgsArena
 void
 DisplayChat(Arena* ScratchArena,
-            Arena* MessagesArena, u32 MessagesNum,
-            Arena* ClientsArena, struct pollfd* fds,
+            message_store* Store, message_index* Index,
+            user_cache* Users, user_lookups* Lookups, struct pollfd* fds,
             wchar_t Input[], u32 InputLen)
 {
     rect TextBox = {
@@ -339,6 +1041,8 @@ DisplayChat(Arena* ScratchArena,
     global.cursor_y = TextR.Y;
     DrawBox(TextBox, 0);
     DrawTextBox(TextR, Input, InputLen);
+    if (Rooms.Current)
+        tb_printf(TextBox.X + 2, TextBox.Y, TB_YELLOW, 0, "#%u", Rooms.Current);
     
     // Print vertical bar
     s32 VerticalBarOffset = TIMESTAMP_LEN + AUTHOR_LEN + 2;
@@ -346,12 +1050,12 @@ DisplayChat(Arena* ScratchArena,
         tb_print(VerticalBarOffset, Y, 0, 0, "│");
     
     // show error popup if server disconnected
-    if (fds[FDS_UNI].fd == -1 || fds[FDS_BI].fd == -1)
+    if (fds[FDS_SERVER].fd == -1)
     {
         popup(TB_RED, TB_BLACK, (u8*)"Server disconnected.");
     }
     
-    // Print messages in msgsArena, if there are too many to display, start printing from an offset.
+    // Print the messages that are visible at the Index->Scroll position.
     // Looks like this:
     //  03:24:29 [1234567890ab] hello homes how are
     //  you doing?
@@ -361,68 +1065,67 @@ DisplayChat(Arena* ScratchArena,
         
         // If there is not enough space to draw, do not draw
         if (FreeHeight <= 0) return;
+        if (!Index->Count) return;
+        
+        if (Index->Width != global.width)
+            reindex_messages(ScratchArena, Store, Index, global.width);
+        
+        message_entry* Entries = Index->Entries.addr;
+        message_entry* Last = Entries + Index->Count - 1;
+        u32 TotalLines = Last->LinesBefore + Last->Lines;
         
-        // Used to go to the next message in MessagesArena by incrementing with the messages' size.
-        u8* MessageAddress = MessagesArena->addr;
-        Assert(MessageAddress != 0);
+        // Clamp scrolling so that the oldest message stays at the top
+        u32 MaxScroll = (TotalLines > FreeHeight) ? TotalLines - FreeHeight : 0;
+        if (Index->Scroll > MaxScroll) Index->Scroll = MaxScroll;
         
-        // Skip messages if there is not enough space to display them all
-        u32 MessagesOffset = (MessagesNum > FreeHeight) ? MessagesNum - FreeHeight : 0;
-        for (u32 MessageIndex = 0; MessageIndex < MessagesOffset; MessageIndex++)
+        u32 BottomLine = TotalLines - Index->Scroll;
+        u32 TopLine = (BottomLine > FreeHeight) ? BottomLine - FreeHeight : 0;
+        
+        // Binary search the last message starting at or before TopLine
+        u32 Low = 0, High = Index->Count - 1;
+        while (Low < High)
         {
-            HeaderMessage* header = (HeaderMessage*)MessageAddress;
-            MessageAddress += sizeof(*header);
-            
-            switch (header->type)
-            {
-                case HEADER_TYPE_TEXT:
-                {
-                    TextMessage* message = (TextMessage*)MessageAddress;
-                    MessageAddress += TEXTMESSAGE_SIZE;
-                    MessageAddress += message->len * sizeof(*message->text);
-                    break;
-                }
-                case HEADER_TYPE_PRESENCE:
-                MessageAddress += sizeof(PresenceMessage);
-                break;
-                case HEADER_TYPE_HISTORY:
-                MessageAddress += sizeof(HistoryMessage);
-                break;
-                default:
-                // unhandled message type
-                Assert(0);
-            }
+            u32 Mid = Low + (High - Low + 1) / 2;
+            if (Entries[Mid].LinesBefore <= TopLine)
+                Low = Mid;
+            else
+                High = Mid - 1;
         }
         
-        u32 MessageY = 0;
+        // The first message can start above the screen
+        s32 MessageY = (s32)Entries[Low].LinesBefore - (s32)TopLine;
         
-        for (u32 i = MessagesOffset;
-             i < MessagesNum;
+        for (u32 i = Low;
+             i < Index->Count;
              i++)
         {
-            if (MessageY >= FreeHeight) break;
+            if (MessageY >= (s32)FreeHeight) break;
             
-            HeaderMessage* header = (HeaderMessage*)MessageAddress;
-            MessageAddress += sizeof(*header);
+            HeaderMessage* header = message_at(Store, Entries[i].Offset);
+            u8* MessageAddress = (u8*)(header + 1);
             
-            User* client = get_user_by_id(ClientsArena, header->id);
+            // Unknown users are requested after drawing, until then show a placeholder.
+            User* client = get_user_by_id(Users, header->id);
             if (!client)
             {
-                LoggingF("User not known, requesting from server\n");
-                client = add_user_info(ClientsArena, fds[FDS_BI].fd, header->id);
+                request_user_info(Lookups, header->id);
+                client = &PlaceholderUser;
             }
-            Assert(client);
             
             switch (header->type)
             {
                 case HEADER_TYPE_TEXT:
                 {
                     TextMessage* message = (TextMessage*)MessageAddress;
-                    
+                    u32 Refused = (header->seq == TEXT_REFUSED);
                     
                     // Color own messages
                     u32 fg = 0;
-                    if (user.ID == header->id)
+                    if (Refused)
+                    {
+                        fg = TB_RED;
+                    }
+                    else if (user.ID == header->id)
                     {
                         fg = TB_CYAN;
                     }
@@ -432,41 +1135,50 @@ DisplayChat(Arena* ScratchArena,
                     }
                     
                     // prefix is of format "HH:MM:SS [<author>] ", create it
-                    u8 timestamp[TIMESTAMP_LEN];
-                    formatTimestamp(timestamp, message->timestamp);
-                    
-                    tb_printf(0, MessageY, TB_WHITE, 0, "%s", timestamp);
-                    tb_printf(TIMESTAMP_LEN, MessageY, fg, 0, "[%s]", client->Author);
+                    if (MessageY >= 0)
+                    {
+                        u8 timestamp[TIMESTAMP_LEN];
+                        formatTimestamp(timestamp, message->timestamp);
+                        
+                        tb_printf(0, MessageY, TB_WHITE, 0, "%s", timestamp);
+                        tb_printf(TIMESTAMP_LEN, MessageY, fg, 0, "[%s]", client->Author);
+                        
+                        // Tag refused messages, direct messages and messages in other rooms than 0
+                        // when there is space left before the bar
+                        if (Refused || message->to || message->room)
+                        {
+                            u8 Tag[12];
+                            s32 TagLen = (Refused) ?
+                                snprintf((char*)Tag, sizeof(Tag), "not sent") : (message->to) ?
+                                snprintf((char*)Tag, sizeof(Tag), "dm") :
+                                snprintf((char*)Tag, sizeof(Tag), "#%u", message->room);
+                            s32 AuthorEnd = TIMESTAMP_LEN + strlen((char*)client->Author) + 2;
+                            if (AuthorEnd + TagLen < VerticalBarOffset)
+                                tb_printf(VerticalBarOffset - TagLen - 1, MessageY, (Refused) ? TB_RED : TB_YELLOW, 0, "%s", Tag);
+                        }
+                    }
                     
                     // Only display when there is enough space
                     if (global.width > VerticalBarOffset + 2)
                     {
+                        ArenaTemp Temp = ArenaTempBegin(ScratchArena);
                         raw_result RawText = markdown_to_raw(ScratchArena, (wchar_t*)&message->text, message->len);
                         markdown_formatoptions MDFormat = preprocess_markdown(ScratchArena,
                                                                               (wchar_t*)&message->text,
                                                                               message->len);
                         
-                        u32 timesWrapped = tb_print_wrapped_with_markdown(VerticalBarOffset + 2, MessageY, fg, 0,
-                                                                          RawText.Text, RawText.Len,
-                                                                          global.width, global.height, MDFormat);
+                        tb_print_wrapped_with_markdown(VerticalBarOffset + 2, MessageY, fg, 0,
+                                                       RawText.Text, RawText.Len,
+                                                       global.width, FreeHeight, MDFormat);
                         
-                        // Free the memory
-                        ScratchArena->pos = 0;
-                        
-                        MessageY += timesWrapped;
-                    }
-                    else
-                    {
-                        // We still displayed the timestamp so we need to increment the Y.
-                        MessageY++;
+                        ArenaTempEnd(Temp);
                     }
-                    
-                    u32 message_size = TEXTMESSAGE_SIZE + message->len * sizeof(*message->text);
-                    MessageAddress += message_size;
                 } break;
                 case HEADER_TYPE_PRESENCE:
                 {
                     PresenceMessage* message = (PresenceMessage*)MessageAddress;
+                    if (MessageY < 0) break;
+                    
                     tb_printf(TIMESTAMP_LEN, MessageY, TB_MAGENTA, 0, "[%s]", client->Author);
                     
                     // Wrap Text in '*'
@@ -479,23 +1191,23 @@ DisplayChat(Arena* ScratchArena,
                     for (u32 i = 1; i < Len + 1; i++) FormattedText[i] = Text[i-1];
                     
                     tb_print_markdown(VerticalBarOffset + 2, MessageY, 0, 0, FormattedText, Len + 2);
-                    
-                    MessageY++;
-                    MessageAddress += sizeof(*message);
                 } break;
                 case HEADER_TYPE_HISTORY:
                 {
-                    HistoryMessage* message = (HistoryMessage*)MessageAddress;
-                    MessageAddress += sizeof(*message);
                     // TODO: implement
                 } break;
                 default:
-                tb_printf(0, MessageY, 0, 0, "%s", headerTypeString(header->type));
-                MessageY++;
+                if (MessageY >= 0)
+                    tb_printf(0, MessageY, 0, 0, "%s", headerTypeString(header->type));
                 break;
             }
+            
+            MessageY += Entries[i].Lines;
         }
         
+        // Show that there are newer messages below
+        if (Index->Scroll)
+            tb_printf(global.width - 8, FreeHeight - 1, TB_BLACK, TB_WHITE, "%6u↓", Index->Scroll);
     }
 }
 
@@ -515,25 +1227,27 @@ main(int argc, char** argv)
     
     s32 err = 0; // error code for functions
     
-    u32 MessagesNum = 0; // Number of messages in msgsArena
     s32 nrecv = 0;     // number of bytes received
     
     wchar_t Input[MAX_INPUT_LEN] = {0}; // input buffer
     u32 InputIndex = 0;               // number of characters in input
     
     Arena ScratchArena;
-    Arena MessagesArena;
-    Arena ClientsArena;
-    ArenaAlloc(&MessagesArena, Megabytes(64));   // Messages received & sent
-    ArenaAlloc(&ClientsArena, Megabytes(1)); // Arena for storing clients
-    ArenaAlloc(&ScratchArena, Megabytes(1)); // Arena for storing clients
+    message_store Store;
+    user_lookups Lookups = {0};
+    store_init(&Store); // Messages received & sent
+    message_index Index = {0};
+    ArenaAlloc(&Index.Entries, Gigabytes(1)); // Entries for messages in Store
+    ArenaAlloc(&ScratchArena, Megabytes(1)); // Arena for temporary allocations
+    
+    user_cache* Users = mmap(0, sizeof(*Users), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    Assert(Users != MAP_FAILED);
+    ArenaAlloc(&Users->Users, USERS_MAX * sizeof(User)); // Arena for storing clients
     
     struct tb_event ev; // event fork keypress & resize
     u8 quit = 0;        // boolean to indicate if we want to quit the main loop
     u8* quitmsg = 0;    // this string will be printed before returning from main
     
-    pthread_t thr_rec; // thread for reconnecting to server when disconnected
-    
 #ifdef LOGGING
     LogFD = open(LOGFILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
     Assert(LogFD != -1);
@@ -541,10 +1255,13 @@ main(int argc, char** argv)
     logfd = 2; // stderr
 #endif
     
+    // Spread out reconnection attempts between clients
+    srand(time(0) ^ getpid());
+    
     // poopoo C cannot infer type
     struct pollfd fds[FDS_MAX] = {
-        {-1, POLLIN, 0}, // FDS_BI
-        {-1, POLLIN, 0}, // FDS_UNI
+        {-1, POLLIN, 0}, // FDS_SERVER
+        {-1, POLLOUT, 0}, // FDS_CONNECT
         {-1, POLLIN, 0}, // FDS_TTY
         {-1, POLLIN, 0}, // FDS_RESIZE
     };
@@ -564,32 +1281,24 @@ main(int argc, char** argv)
 #endif
     /* Authentication */
     {
-        s32 unifd, bifd;
-        bifd = get_connection(&address);
-        if (bifd == -1)
+        s32 serverfd = get_connection(&address);
+        if (serverfd == -1)
         {
             LoggingF("errno: %d\n", errno);
             return 1;
         }
-        unifd = get_connection(&address);
-        if (unifd == -1)
-        {
-            LoggingF("errno: %d\n", errno);
-            return 1;
-        }
-        LoggingF("(%d,%d)\n", bifd, unifd);
-        if (!authenticate(&user, bifd) ||
-            !authenticate(&user, unifd))
+        LoggingF("(%d)\n", serverfd);
+        if (!authenticate(&user, serverfd))
         {
             LoggingF("errno: %d\n", errno);
             return 1;
         }
         else
         {
-            LoggingF("Authenticated (%d,%d)\n", bifd, unifd);
+            LoggingF("Authenticated (%d)\n", serverfd);
         }
-        fds[FDS_BI].fd = bifd;
-        fds[FDS_UNI].fd = unifd;
+        fds[FDS_SERVER].fd = serverfd;
+        heartbeat_reset();
     }
     
 #ifdef IMPORT_ID
@@ -604,73 +1313,195 @@ main(int argc, char** argv)
     
     // init
     tb_init();
+    tb_set_input_mode(TB_INPUT_ESC | TB_INPUT_MOUSE);
     tb_get_fds(&fds[FDS_TTY].fd, &fds[FDS_RESIZE].fd);
     
     DisplayChat(&ScratchArena,
-                &MessagesArena, MessagesNum,
-                &ClientsArena, fds,
+                &Store, &Index,
+                Users, &Lookups, fds,
                 Input, InputIndex);
     tb_present();
+    send_user_lookups(&Lookups, fds[FDS_SERVER].fd);
     
     // main loop
     while (!quit)
     {
-        err = poll(fds, FDS_MAX, TIMEOUT_POLL);
+        s32 Timeout = TIMEOUT_POLL;
+        if (fds[FDS_SERVER].fd != -1)
+            Timeout = heartbeat_timeout(ack_timeout(TIMEOUT_POLL));
+        err = poll(fds, FDS_MAX, reconnect_timeout(&Reconnect, Timeout));
         // ignore resize events and use them to redraw the screen
         Assert(err != -1 || errno == EINTR);
         
         tb_clear();
         
-        if (fds[FDS_UNI].revents & POLLIN)
+        if (fds[FDS_CONNECT].revents)
+            reconnect_connected(&Reconnect, fds);
+        else if (Reconnect.NextTry && Reconnect.NextTry <= get_time_ms())
+            reconnect_start(&Reconnect, fds);
+        
+        if (fds[FDS_SERVER].revents & (POLLIN | POLLHUP | POLLERR))
         {
             // got data from server
             HeaderMessage header;
-            nrecv = recv(fds[FDS_UNI].fd, &header, sizeof(header), 0);
-            Assert(nrecv != -1);
+            nrecv = recv(fds[FDS_SERVER].fd, &header, sizeof(header), MSG_WAITALL);
+            if (nrecv == sizeof(header))
+                heartbeat_reset();
             
             // Server disconnects
-            if (nrecv == 0)
+            if (nrecv != sizeof(header))
+            {
+                LoggingF("Disconnected, trying to reconnect\n");
+                server_lost(fds, &Lookups);
+            }
+            else if (header.version != PROTOCOL_VERSION)
+            {
+                LoggingF("Header received does not match version\n");
+                continue;
+            }
+            /* Heartbeats, see "Heartbeats" in protocol.h */
+            else if (header.type == HEADER_TYPE_PING || header.type == HEADER_TYPE_PONG)
+            {
+                PingMessage message;
+                nrecv = recv(fds[FDS_SERVER].fd, &message, sizeof(message), MSG_WAITALL);
+                Assert(nrecv == sizeof(message));
+                if (header.type == HEADER_TYPE_PING)
+                    send_ping(fds[FDS_SERVER].fd, HEADER_TYPE_PONG, &message);
+                else
+                    LoggingF("Pong after %lums\n", get_time_ms() - message.timestamp);
+            }
+            /* Answers to requests */
+            else if (header.request)
+            {
+                switch (header.type)
+                {
+                    case HEADER_TYPE_INTRODUCTION:
+                    {
+                        IntroductionMessage message;
+                        nrecv = recv(fds[FDS_SERVER].fd, &message, sizeof(message), 0);
+                        Assert(nrecv == sizeof(message));
+                        if (!get_user_by_id(Users, header.id))
+                            add_user_info(Users, &Lookups, header.id, message.author);
+                    } break;
+                    case HEADER_TYPE_ERROR:
+                    {
+                        ErrorMessage message;
+                        nrecv = recv(fds[FDS_SERVER].fd, &message, sizeof(message), 0);
+                        Assert(nrecv == sizeof(message));
+                        LoggingF("Request #%u for %lu: %s\n", header.request, header.id,
+                                 errorTypeString(message.type));
+                        if (header.request == Rooms.Request)
+                        {
+                            if (message.type == ERROR_TYPE_SUCCESS)
+                                Rooms.Current = Rooms.Pending;
+                            Rooms.Request = 0;
+                        }
+                        // Remember unknown users so they are not requested again
+                        else if (header.id && message.type == ERROR_TYPE_NOTFOUND &&
+                                 !get_user_by_id(Users, header.id))
+                            add_user_info(Users, &Lookups, header.id, (u8*)UNKNOWN_AUTHOR);
+                        // A sent text was not forwarded
+                        else if (message.type != ERROR_TYPE_SUCCESS &&
+                                 !refuse_text(&Store, &Index, header.request))
+                            LoggingF("No text for request #%u\n", header.request);
+                    } break;
+                    default:
+                    LoggingF("Got unhandled answer: %s\n", headerTypeString(header.type));
+                    break;
+                }
+            }
+            /* Several notifications at once */
+            else if (header.type == HEADER_TYPE_BATCH)
             {
-                // close diconnected server's socket
-                err = close(fds[FDS_UNI].fd);
-                Assert(err == 0);
-                fds[FDS_UNI].fd = -1; // ignore
-                // start trying to reconnect in a thread
-                err = pthread_create(&thr_rec, 0, &thread_reconnect, (void*)fds);
-                Assert(err == 0);
+                recv_batch(&ScratchArena, &Store, &Index, Users, &Lookups, fds[FDS_SERVER].fd, &header);
             }
+            /* Notifications */
             else
             {
-                if (header.version != PROTOCOL_VERSION)
+                if (!accept_notification(fds[FDS_SERVER].fd, &header))
                 {
-                    LoggingF("Header received does not match version\n");
+                    discard_message(&ScratchArena, fds[FDS_SERVER].fd, &header);
                     continue;
                 }
                 
-                void* addr = ArenaPush(&MessagesArena, sizeof(header));
+                store_reserve(&Store);
+                u64 Offset = store_offset(&Store);
+                void* addr = ArenaPush(&Store.Recent, sizeof(header));
                 memcpy(addr, &header, sizeof(header));
                 
                 // Messages handled from server
                 switch (header.type)
                 {
                     case HEADER_TYPE_TEXT:
-                    recvTextMessage(&MessagesArena, fds[FDS_UNI].fd);
-                    MessagesNum++;
+                    recvTextMessage(&Store.Recent, fds[FDS_SERVER].fd);
+                    index_message(&ScratchArena, &Store, &Index, Offset);
                     break;
                     case HEADER_TYPE_PRESENCE:;
-                    PresenceMessage* message = ArenaPush(&MessagesArena, sizeof(*message));
-                    nrecv = recv(fds[FDS_UNI].fd, message, sizeof(*message), 0);
+                    PresenceMessage* message = ArenaPush(&Store.Recent, sizeof(*message));
+                    nrecv = recv(fds[FDS_SERVER].fd, message, sizeof(*message), MSG_WAITALL);
                     Assert(nrecv != -1);
                     Assert(nrecv == sizeof(*message));
-                    MessagesNum++;
+                    index_message(&ScratchArena, &Store, &Index, Offset);
+                    if (!get_user_by_id(Users, header.id))
+                        add_user_info(Users, &Lookups, header.id, message->author);
                     break;
+                    case HEADER_TYPE_ROSTER:
+                    {
+                        // Online users, only kept in the user cache, see "Roster" in protocol.h
+                        RosterMessage message;
+                        nrecv = recv(fds[FDS_SERVER].fd, &message, sizeof(message), MSG_WAITALL);
+                        Assert(nrecv == sizeof(message));
+                        if (message.len > ROSTER_MAX)
+                            message.len = ROSTER_MAX;
+                        for (u32 i = 0; i < message.len; i++)
+                        {
+                            RosterEntry* entry = message.entries + i;
+                            if (!get_user_by_id(Users, entry->id))
+                                add_user_info(Users, &Lookups, entry->id, entry->author);
+                        }
+                        LoggingF("Got roster of %u user(s)\n", message.len);
+                        ArenaPopTo(&Store.Recent, Offset - Store.Spilled);
+                    } break;
+                    case HEADER_TYPE_ERROR:
+                    {
+                        // Eg. a sent message was dropped because of rate limits
+                        ErrorMessage message;
+                        nrecv = recv(fds[FDS_SERVER].fd, &message, sizeof(message), MSG_WAITALL);
+                        Assert(nrecv == sizeof(message));
+                        LoggingF("Got error: %s, retry after %ums\n", errorTypeString(message.type), message.retry);
+                        ArenaPopTo(&Store.Recent, Offset - Store.Spilled);
+                        // The server is shutting down, see "Restarts" in protocol.h
+                        if (message.type == ERROR_TYPE_RESTARTING)
+                        {
+                            Reconnect.RetryAfter = message.retry;
+                            server_lost(fds, &Lookups);
+                        }
+                    } break;
                     default:
                     LoggingF("Got unhandled message: %s\n", headerTypeString(header.type));
+                    ArenaPopTo(&Store.Recent, Offset - Store.Spilled);
                     break;
                 }
             }
         }
         
+        if (fds[FDS_SERVER].fd != -1 && Session.Acked != Session.Seq && !ack_timeout(ACK_INTERVAL))
+            send_ack(fds[FDS_SERVER].fd, ACK_TYPE_RECEIVED);
+        
+        if (fds[FDS_SERVER].fd != -1 && !heartbeat_timeout(HEARTBEAT_INTERVAL))
+        {
+            if (Heartbeat.Missed == HEARTBEAT_MISSED)
+            {
+                LoggingF("Server missed %u heartbeats, trying to reconnect\n", Heartbeat.Missed);
+                server_lost(fds, &Lookups);
+            }
+            else
+            {
+                PingMessage message = {.timestamp = get_time_ms()};
+                send_ping(fds[FDS_SERVER].fd, HEADER_TYPE_PING, &message);
+            }
+        }
+        
         if (fds[FDS_TTY].revents & POLLIN)
         {
             // got a key event
@@ -758,6 +1589,21 @@ main(int argc, char** argv)
                 case TB_KEY_CTRL_C:
                 quit = 1;
                 break;
+                // Scrolling, clamped when drawing
+                case TB_KEY_PGUP:
+                Index.Scroll += (global.height > 4) ? global.height - 4 : 1;
+                break;
+                case TB_KEY_PGDN:
+                {
+                    u32 Lines = (global.height > 4) ? global.height - 4 : 1;
+                    Index.Scroll = (Index.Scroll > Lines) ? Index.Scroll - Lines : 0;
+                } break;
+                case TB_KEY_MOUSE_WHEEL_UP:
+                Index.Scroll += SCROLL_WHEEL_LINES;
+                break;
+                case TB_KEY_MOUSE_WHEEL_DOWN:
+                Index.Scroll = (Index.Scroll > SCROLL_WHEEL_LINES) ? Index.Scroll - SCROLL_WHEEL_LINES : 0;
+                break;
                 case TB_KEY_CTRL_M: // send message
                 {
                     raw_result RawText = markdown_to_raw(0, Input, InputIndex);
@@ -765,35 +1611,86 @@ main(int argc, char** argv)
                     if (RawText.Len == 0)
                         // do not send empty message
                         break;
-                    if (fds[FDS_UNI].fd == -1)
+                    if (fds[FDS_SERVER].fd == -1)
                         // do not send message to disconnected server
                         break;
                     
+                    // Room commands, "/join <room>" and "/leave"
+                    if (!wcsncmp(Input, L"/join ", 6))
+                    {
+                        Input[InputIndex] = 0;
+                        RoomID Room = wcstoul(Input + 6, 0, 10);
+                        if (Room)
+                            send_room_request(fds[FDS_SERVER].fd, ROOM_TYPE_JOIN, Room);
+                        goto clear_input;
+                    }
+                    if (InputIndex == 6 && !wcsncmp(Input, L"/leave", 6))
+                    {
+                        if (Rooms.Current)
+                            send_room_request(fds[FDS_SERVER].fd, ROOM_TYPE_LEAVE, Rooms.Current);
+                        Rooms.Current = 0;
+                        goto clear_input;
+                    }
+                    
+                    // Direct message, "/msg <user> <text>" where user is a name or an ID
+                    ID To = 0;
+                    if (!wcsncmp(Input, L"/msg ", 5))
+                    {
+                        u32 NameEnd = 5;
+                        while (NameEnd < InputIndex && Input[NameEnd] != L' ') NameEnd++;
+                        if (NameEnd == InputIndex || NameEnd - 5 >= AUTHOR_LEN) goto clear_input;
+                        
+                        u8 Name[AUTHOR_LEN] = {0};
+                        for (u32 i = 5; i < NameEnd; i++) Name[i - 5] = Input[i];
+                        
+                        User* Recipient = get_user_by_name(Users, Name);
+                        To = (Recipient) ? Recipient->ID : strtoul((char*)Name, 0, 10);
+                        if (!To)
+                        {
+                            LoggingF("Unknown user %s\n", Name);
+                            goto clear_input;
+                        }
+                        
+                        // Only send the text after the name
+                        InputIndex -= NameEnd + 1;
+                        memmove(Input, Input + NameEnd + 1, InputIndex * sizeof(*Input));
+                        bzero(Input + InputIndex, (NameEnd + 1) * sizeof(*Input));
+                        if (!InputIndex) break;
+                    }
+                    
                     // null terminate
                     Input[InputIndex] = 0;
                     InputIndex++;
                     
                     // Save header
-                    HeaderMessage* header = ArenaPush(&MessagesArena, sizeof(*header));
-                    header->version = PROTOCOL_VERSION;
-                    header->type = HEADER_TYPE_TEXT;
+                    store_reserve(&Store);
+                    u64 Offset = store_offset(&Store);
+                    HeaderMessage* header = ArenaPush(&Store.Recent, sizeof(*header));
+                    *header = (HeaderMessage)HEADER_INIT(HEADER_TYPE_TEXT);
                     header->id = user.ID;
+                    // Answered only when refused, see refuse_text()
+                    header->request = new_request();
                     
                     // Save message
-                    TextMessage* sendmsg = ArenaPush(&MessagesArena, TEXTMESSAGE_SIZE);
+                    TextMessage* sendmsg = ArenaPush(&Store.Recent, TEXTMESSAGE_SIZE);
                     sendmsg->timestamp = time(0);
                     sendmsg->len = InputIndex;
+                    sendmsg->room = Rooms.Current;
+                    sendmsg->to = To;
                     
                     u32 text_size = InputIndex * sizeof(*Input);
-                    ArenaPush(&MessagesArena, text_size);
+                    ArenaPush(&Store.Recent, text_size);
                     memcpy(&sendmsg->text, Input, text_size);
                     
-                    sendAnyMessage(fds[FDS_UNI].fd, *header, sendmsg);
+                    sendAnyMessage(fds[FDS_SERVER].fd, *header, sendmsg);
                     
-                    MessagesNum++;
+                    index_message(&ScratchArena, &Store, &Index, Offset);
+                    // Jump back to the newest message
+                    Index.Scroll = 0;
                     // also clear input
                 } // fallthrough
                 case TB_KEY_CTRL_U: // clear input
+                clear_input:
                 bzero(Input, InputIndex * sizeof(*Input));
                 InputIndex = 0;
                 break;
@@ -813,16 +1710,18 @@ main(int argc, char** argv)
                 break;
         }
         
-        // These are used to redraw the screen from threads
+        // These are used to redraw the screen from signals
         if (fds[FDS_RESIZE].revents & POLLIN)
         {
             // ignore
             tb_poll_event(&ev);
         }
         
-        DisplayChat(&ScratchArena, &MessagesArena, MessagesNum, &ClientsArena, fds, Input, InputIndex);
+        DisplayChat(&ScratchArena, &Store, &Index, Users, &Lookups, fds, Input, InputIndex);
         
         tb_present();
+        
+        send_user_lookups(&Lookups, fds[FDS_SERVER].fd);
     }
     
     tb_shutdown();
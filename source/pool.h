@@ -0,0 +1,98 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "arena.h"
+
+// Slots start on a cache line so two slots never share one
+#define POOL_ALIGN 64
+// Byte written over freed slots in debug builds, see PoolFree()
+#define POOL_POISON 0xDD
+
+// Pool Allocator
+// Hands out fixed size slots from an arena, freed slots are kept in a free list and reused
+// before new ones are pushed.  Pointers to slots stay valid until they are freed.
+typedef struct PoolSlot PoolSlot;
+struct PoolSlot {
+    PoolSlot* next;
+};
+
+typedef struct {
+    Arena arena;
+    A_u64 slotSize; // multiple of POOL_ALIGN
+    PoolSlot* free; // first freed slot
+    A_u64 count;    // slots in use
+} Pool;
+
+#define PoolAllocType(pool, type, count) PoolAlloc((pool), sizeof(type), (count))
+#define PoolPushStruct(pool, type) (type*)PoolPush(pool)
+
+void PoolAlloc(Pool* pool, A_u64 size, A_u64 count);
+void PoolRelease(Pool* pool);
+void* PoolPush(Pool* pool);
+void PoolFree(Pool* pool, void* slot);
+
+#endif // POOL_H
+
+#ifdef POOL_IMPL
+
+// Reserve space in pool for count slots of size bytes.
+void
+PoolAlloc(Pool* pool, A_u64 size, A_u64 count)
+{
+    if (size < sizeof(PoolSlot))
+        size = sizeof(PoolSlot);
+    pool->slotSize = (size + POOL_ALIGN - 1) & ~(A_u64)(POOL_ALIGN - 1);
+    ArenaAlloc(&pool->arena, pool->slotSize * count + POOL_ALIGN);
+    pool->free = 0;
+    pool->count = 0;
+}
+
+void
+PoolRelease(Pool* pool)
+{
+    ArenaRelease(&pool->arena);
+}
+
+// Returns a slot, a freed one if there is one.  Its contents are undefined.
+// Returns 0 if all the slots PoolAlloc() reserved are in use.
+void*
+PoolPush(Pool* pool)
+{
+    PoolSlot* slot = pool->free;
+    if (slot)
+    {
+        pool->free = slot->next;
+#ifdef DEBUG
+        // Something wrote to the slot after it was freed
+        for (A_u64 i = sizeof(*slot); i < pool->slotSize; i++)
+            Assert(((A_u8*)slot)[i] == POOL_POISON);
+#endif
+    }
+    else
+    {
+        A_u64 pos = (pool->arena.pos + POOL_ALIGN - 1) & ~(A_u64)(POOL_ALIGN - 1);
+        if (pos + pool->slotSize > pool->arena.size) return 0;
+        slot = ArenaPushAligned(&pool->arena, pool->slotSize, POOL_ALIGN);
+    }
+    pool->count++;
+
+    return slot;
+}
+
+// Give slot back to pool.  In debug builds it is filled with POOL_POISON so that uses after
+// freeing stand out.
+void
+PoolFree(Pool* pool, void* slot)
+{
+    Assert(pool->count);
+#ifdef DEBUG
+    memset(slot, POOL_POISON, pool->slotSize);
+#endif
+    PoolSlot* freed = slot;
+    freed->next = pool->free;
+    pool->free = freed;
+    pool->count--;
+}
+
+#undef POOL_IMPL
+#endif // POOL_IMPL
@@ -32,15 +32,119 @@
 //      2. server-> Sends & Saves ID
 //      3. Save ID
 //
-//      BIFD & UNIFD
-//      Each client has 2 connections that must be authenticated one for 2-way
-//      communication and one for 1-way communication.  Respectively BIFD and
-//      UNIFD.  BIFD must be authenticated first and is meant for requests such
-//      as getting an IntroductionMessage for a sent IDMessage.
-//      UNIFD is for messages that are like notifications.  For example
-//      PresenceMessage that tells us when another user connected.
-//      These two connections separate these message types so we do not have to
-//      worry about receiving a PresenceMessage when waiting for an a response.
+//      Each client has a single connection to the server that is authenticated once.
+//      After a successful authentication the server sends a SessionMessage, see "Sessions".
+//
+/// Requests
+//      Messages that expect an answer (eg. IDListMessage) are sent with a non-zero request
+//      number in the header, chosen by the client.  The server copies this number into the
+//      header of each answer.  Notifications that were not requested (eg. TextMessage,
+//      PresenceMessage) have request 0.  This way answers and notifications can be received
+//      on the same connection in any order.  A TextMessage may be sent with a request number
+//      too, it is only answered when the server refuses it.
+//
+/// Sessions
+//      Notifications are numbered by the server with an increasing sequence number in the
+//      header, other messages have sequence number 0.  The server keeps the latest
+//      notifications so that a client that lost its connection can resume its session:
+//      1. client-> ResumeMessage with its ID, session token and last received sequence number
+//      2. server-> knows session and still has the notifications after that sequence number?
+//           y. 1. server-> Success
+//              2. server-> Sends the missed notifications
+//           n. 1. server-> Error 'notfound' or 'expired'
+//              2. client-> authenticate again on a new connection
+//      The client is only reported as disconnected to others when it did not resume its
+//      session shortly after losing its connection.
+//
+/// Acknowledgements
+//      Each notification also carries the sequence number of the notification sent to the same
+//      client before it (prev), so the client notices when it missed one in between:
+//      1. client-> AckMessage 'received' with its last received sequence number, periodically
+//      2. client-> receives a notification whose prev is after its last received one?
+//           y. 1. client-> AckMessage 'missing' with its last received sequence number
+//              2. server-> Sends the notifications after it again
+//              3. client-> ignores notifications until the first one with a matching prev
+//      When the server no longer has them the next notification has prev 0.  A client that
+//      authenticates again gets the notifications after its last acknowledgement, see
+//      "Inbox".
+//
+/// Heartbeats
+//      Either side sends a PingMessage when it did not receive anything from the other for
+//      HEARTBEAT_INTERVAL, which is answered with a PongMessage carrying the same timestamp.
+//      A connection on which HEARTBEAT_MISSED pings in a row went unanswered is closed, the
+//      client then reconnects and resumes its session.  Pings and pongs are not notifications,
+//      they have no sequence number.
+//      The server closes connections that did not authenticate within HEARTBEAT_INTERVAL.
+//
+/// Batches
+//      When the server has several notifications for a client at once (replaying a session,
+//      missed notifications, the inbox or presence changes) it sends them in BatchMessages
+//      instead of one frame each.  Presence changes are collected for a short time first, a
+//      client that connects and disconnects again within it is not reported at all.  A
+//      BatchMessage has request 0, sequence number 0 and prev set to the sequence number of the
+//      notification sent before the batch.  Its entries are handled like notifications
+//      received one by one, the prev of an entry is the sequence number of the entry before it.
+//      Each entry is encoded as:
+//      - 1 byte for the type, HEADER_TYPE_TEXT or HEADER_TYPE_PRESENCE
+//      - varint for the sequence number, minus the one of the entry before
+//      - varint for the id, minus the one of the entry before
+//      HEADER_TYPE_TEXT
+//      - varint for the timestamp, minus the one of the text entry before
+//      - varint for the room
+//      - varint for the recipient
+//      - varint for the text length
+//      - x*4 bytes for the text
+//      HEADER_TYPE_PRESENCE
+//      - 1 byte for type
+//      - 13 bytes for the author
+//      Varints hold 7 bits per byte starting with the lowest, the high bit is set when another
+//      byte follows.  Differences are zigzag encoded so small negative ones stay short, the
+//      first entry is encoded against 0.
+//
+/// Rooms
+//      Every TextMessage is sent in a room.  Room 0 is the room all clients are in, other rooms
+//      are joined and left with a RoomMessage request, the server answers with an ErrorMessage
+//      'success', 'notfound' when leaving a room the client is not in, or 'too many rooms' when
+//      the room cannot be created, is full or the client is in too many rooms already.
+//      TextMessages in a room are only sent to its members, a client that sends to a room it
+//      did not join gets an ErrorMessage 'notfound' for its request.  Joined rooms are kept
+//      until the client leaves them, also while it is offline.
+//
+/// Roster
+//      After authenticating with an IDMessage or IntroductionMessage the server sends the
+//      clients that are online as RosterMessages with request 0 and sequence number 0, before
+//      the inbox.  Every PresenceMessage carries the author of the client it is about, so
+//      together they tell the client who is online without asking for each ID.  A client that
+//      did not send a TextMessage for a while is reported as 'afk', and as 'back' on its next
+//      TextMessage.  Only senders that were not online since still need an IDListMessage.
+//
+/// Inbox
+//      After authenticating with an IDMessage the server sends the TextMessages the client
+//      did not acknowledge before going offline, in room 0 and the rooms it is a member of,
+//      with their sequence numbers.  Only the latest ones are kept.  They are followed by the
+//      direct messages it received while offline.
+//
+/// Direct messages
+//      A TextMessage with a non-zero 'to' is only sent to the client with that ID, its room is
+//      ignored.  When the recipient is offline the server keeps the message and sends it after
+//      the recipient authenticates, of many messages only the most recent ones are kept.
+//      Direct messages are not numbered (sequence number 0) and not replayed when resuming a
+//      session.  Sending to an unknown ID is answered with an ErrorMessage 'notfound' for its
+//      request.
+//
+/// Rate limits
+//      The server limits how many TextMessages and bytes of text each client can send.  A
+//      message over the limit is not forwarded, instead the sender gets an ErrorMessage
+//      'too many messages' for its request and the time to wait as retry.  A message that is
+//      larger than the limit allows at once is answered with 'bad message' instead, because
+//      waiting would not help.
+//
+/// Restarts
+//      Before shutting down the server sends each client an ErrorMessage 'restarting' with
+//      request 0 and the time to wait before reconnecting as retry, then closes the
+//      connection once the client closed its side.  Sessions do not survive this, clients
+//      authenticate again.  When the server is upgraded by handing its connections to a new
+//      server process instead, clients keep their connection and session and notice nothing.
 //
 /// Naming conventions
 // Messages end with the Message suffix (eg. TextMessag, HistoryMessage)
@@ -48,7 +152,7 @@
 // A function that is coupled to a type works like
 // <noun><type> eg. (printTextMessage, formatTimestamp)
 
-#define PROTOCOL_VERSION 0
+#define PROTOCOL_VERSION 11
 // Size of author string including null terminator
 #define AUTHOR_LEN 13
 // Size of formatted timestamp string including null terminator
@@ -56,14 +160,21 @@
 #define TIMESTAMP_FORMAT "%H:%M:%S"
 
 typedef u64 ID;
+typedef u32 RoomID;
 
 // - 2 bytes for version
 // - 1 byte for message type
-// - 16 bytes for checksum
+// - 4 bytes for request number
+// - 8 bytes for id
+// - 8 bytes for sequence number
+// - 8 bytes for sequence number of the previous notification, see "Acknowledgements"
 typedef struct {
     u16 version;
     u8 type;
+    u32 request;
     ID id;
+    u64 seq;
+    u64 prev;
 } HeaderMessage;
 
 typedef enum {
@@ -72,23 +183,35 @@ typedef enum {
     HEADER_TYPE_PRESENCE,
     HEADER_TYPE_ID,
     HEADER_TYPE_INTRODUCTION,
-    HEADER_TYPE_ERROR
+    HEADER_TYPE_ERROR,
+    HEADER_TYPE_IDLIST,
+    HEADER_TYPE_SESSION,
+    HEADER_TYPE_RESUME,
+    HEADER_TYPE_ROOM,
+    HEADER_TYPE_ACK,
+    HEADER_TYPE_ROSTER,
+    HEADER_TYPE_BATCH,
+    HEADER_TYPE_PING,
+    HEADER_TYPE_PONG
 } HeaderType;
 // shorthand for creating a header with a value from the enum
-#define HEADER_INIT(t) {.version = PROTOCOL_VERSION, .type = t, .id = 0}
+#define HEADER_INIT(t) {.version = PROTOCOL_VERSION, .type = t, .request = 0, .id = 0, .seq = 0, .prev = 0}
 // from Tsoding video on minicel (https://youtu.be/HCAgvKQDJng?t=4546)
 // sv(https://github.com/tsoding/sv)
-#define HEADER_FMT "header: v%d %s(%d) [%d]"
-#define HEADER_ARG(header) header.version, headerTypeString(header.type), header.type, header.id
+#define HEADER_FMT "header: v%d %s(%d) #%u [%lu] seq:%lu"
+#define HEADER_ARG(header) header.version, headerTypeString(header.type), header.type, header.request, header.id, header.seq
 
 // For sending texts to other clients
-// - 13 bytes for the author
 // - 8 bytes for the timestamp
 // - 2 bytes for the text length
+// - 4 bytes for the room, see "Rooms"
+// - 8 bytes for the recipient, 0 if the message is not a direct message
 // - x*4 bytes for the text
 typedef struct {
     u64 timestamp; // timestamp of when the message was sent
     u16 len;
+    RoomID room;
+    ID to;
     wchar_t* text; // placeholder for indexing
                    // wchar_t* is used, because this renders the text in the debugger
 } TextMessage;
@@ -112,33 +235,150 @@ typedef struct {
 
 // Notifying the sender's state, such as "connected", "disconnected", "AFK", ...
 // - 1 byte for type
+// - 13 bytes for the sender's author, see "Roster"
 typedef struct {
     u8 type;
+    u8 author[AUTHOR_LEN];
 } PresenceMessage;
 typedef enum {
     PRESENCE_TYPE_CONNECTED = 0,
     PRESENCE_TYPE_DISCONNECTED,
-    PRESENCE_TYPE_AFK
+    PRESENCE_TYPE_AFK,
+    PRESENCE_TYPE_BACK
 } PresenceType;
 
 // Send an error message
 // - 1 byte for type
+// - 4 bytes for the time in milliseconds the client should wait before trying again, 0 if
+//   there is no such hint.
 typedef struct {
     u8 type;
+    u32 retry;
 } ErrorMessage;
 typedef enum {
     ERROR_TYPE_BADMESSAGE = 0,
     ERROR_TYPE_NOTFOUND,
     ERROR_TYPE_SUCCESS,
     ERROR_TYPE_ALREADYCONNECTED,
-    ERROR_TYPE_TOOMANYCONNECTIONS
+    ERROR_TYPE_TOOMANYCONNECTIONS,
+    ERROR_TYPE_EXPIRED,
+    ERROR_TYPE_TOOMANYMESSAGES,
+    ERROR_TYPE_TOOMANYROOMS,
+    ERROR_TYPE_RESTARTING
 } ErrorType;
-#define ERROR_INIT(t) {.type = t}
+#define ERROR_INIT(t) {.type = t, .retry = 0}
 
 typedef struct {
     ID id;
 } IDMessage;
 
+// Requesting information about multiple clients at once.  The server answers with an
+// IntroductionMessage for each ID, with header.id set to that ID, or an ErrorMessage 'notfound'
+// with header.id set to the unknown ID.
+// - 1 byte for the number of ids
+// - IDLIST_MAX*8 bytes for the ids
+#define IDLIST_MAX 16
+typedef struct {
+    u8 len;
+    ID ids[IDLIST_MAX];
+} IDListMessage;
+
+// Sent by the server after authentication.  See "Sessions".
+// - 8 bytes for the session token
+// - 8 bytes for the sequence number of the last notification
+typedef struct {
+    u64 token;
+    u64 seq;
+} SessionMessage;
+
+// Resume a session on a new connection.  See "Sessions".
+// - 8 bytes for id
+// - 8 bytes for the session token
+// - 8 bytes for the sequence number of the last received notification
+typedef struct {
+    ID id;
+    u64 token;
+    u64 seq;
+} ResumeMessage;
+
+// Join or leave a room.  See "Rooms".
+// - 1 byte for type
+// - 4 bytes for the room
+typedef struct {
+    u8 type;
+    RoomID room;
+} RoomMessage;
+typedef enum {
+    ROOM_TYPE_JOIN = 0,
+    ROOM_TYPE_LEAVE
+} RoomType;
+
+// Acknowledge received notifications.  See "Acknowledgements".
+// - 1 byte for type
+// - 8 bytes for the sequence number of the last received notification
+typedef struct {
+    u8 type;
+    u64 seq;
+} AckMessage;
+typedef enum {
+    ACK_TYPE_RECEIVED = 0,
+    ACK_TYPE_MISSING
+} AckType;
+
+// Heartbeat, answered with the same message as HEADER_TYPE_PONG.  See "Heartbeats".
+// - 8 bytes for the time in milliseconds the ping was sent, only meaningful to its sender
+#define HEARTBEAT_INTERVAL (30 * 1000)
+#define HEARTBEAT_MISSED 3
+typedef struct {
+    u64 timestamp;
+} PingMessage;
+
+// Clients that are online, sent in parts of at most ROSTER_MAX clients.  See "Roster".
+// - 1 byte for the number of clients
+// - ROSTER_MAX*24 bytes for the ids and authors
+#define ROSTER_MAX 32
+typedef struct {
+    ID id;
+    u8 author[AUTHOR_LEN];
+} RosterEntry;
+typedef struct {
+    u8 len;
+    RosterEntry entries[ROSTER_MAX];
+} RosterMessage;
+
+// Several notifications in one frame.  See "Batches".
+// - 2 bytes for the number of entries
+// - 4 bytes for the size of the entries in bytes, at most BATCH_SIZE
+// - the entries
+typedef struct {
+    u16 count;
+    u32 size;
+} BatchMessage;
+#define BATCH_SIZE Kilobytes(512)
+// Largest encoded varint
+#define VARINT_MAX 10
+
+// Appends entries to a BatchMessage on an arena, see batchBegin().  The arena is sent as is so
+// nothing is aligned, message is copied to where it is in the arena after each entry.
+typedef struct {
+    u8* at;                // where message is in the arena, 0 when no batch was started
+    BatchMessage message;
+    u64 seq;               // values of the last entry, the next one is encoded against them
+    ID id;
+    u64 timestamp;
+} Batch;
+
+// Reads the entries of a received BatchMessage, see batchRead()
+typedef struct {
+    u8* at;
+    u8* end;
+    u32 left;              // entries not read yet
+    u64 prev;
+    u64 seq;
+    ID id;
+    u64 timestamp;
+} BatchReader;
+
 typedef struct {
     s32 nrecv;
     TextMessage* message;
@@ -156,6 +396,15 @@ headerTypeString(HeaderType type)
     case HEADER_TYPE_ID: return (u8*)"IDMessage";
     case HEADER_TYPE_INTRODUCTION: return (u8*)"IntroductionMessage";
     case HEADER_TYPE_ERROR: return (u8*)"ErrorMessage";
+    case HEADER_TYPE_IDLIST: return (u8*)"IDListMessage";
+    case HEADER_TYPE_SESSION: return (u8*)"SessionMessage";
+    case HEADER_TYPE_RESUME: return (u8*)"ResumeMessage";
+    case HEADER_TYPE_ROOM: return (u8*)"RoomMessage";
+    case HEADER_TYPE_ACK: return (u8*)"AckMessage";
+    case HEADER_TYPE_ROSTER: return (u8*)"RosterMessage";
+    case HEADER_TYPE_BATCH: return (u8*)"BatchMessage";
+    case HEADER_TYPE_PING: return (u8*)"PingMessage";
+    case HEADER_TYPE_PONG: return (u8*)"PongMessage";
     default: return (u8*)"Unknown";
     }
 }
@@ -168,6 +417,7 @@ presenceTypeString(PresenceType type)
     case PRESENCE_TYPE_CONNECTED: return (u8*)"connected";
     case PRESENCE_TYPE_DISCONNECTED: return (u8*)"disconnected";
     case PRESENCE_TYPE_AFK: return (u8*)"afk";
+    case PRESENCE_TYPE_BACK: return (u8*)"back";
     default: return (u8*)"Unknown";
     }
 }
@@ -182,6 +432,10 @@ errorTypeString(ErrorType type)
     case ERROR_TYPE_SUCCESS: return (u8*)"success";
     case ERROR_TYPE_ALREADYCONNECTED: return (u8*)"already connected";
     case ERROR_TYPE_TOOMANYCONNECTIONS: return (u8*)"too many connections";
+    case ERROR_TYPE_EXPIRED: return (u8*)"expired";
+    case ERROR_TYPE_TOOMANYMESSAGES: return (u8*)"too many messages";
+    case ERROR_TYPE_TOOMANYROOMS: return (u8*)"too many rooms";
+    case ERROR_TYPE_RESTARTING: return (u8*)"restarting";
     default: return (u8*)"Unknown";
     }
 }
@@ -200,10 +454,10 @@ formatTimestamp(u8 timestamp_str[TIMESTAMP_LEN], u64 timestamp)
 TextMessage*
 recvTextMessage(Arena* msgsArena, u32 fd)
 {
-    TextMessage* message = ArenaPush(msgsArena, TEXTMESSAGE_SIZE);
+    TextMessage* message = ArenaPushAligned(msgsArena, TEXTMESSAGE_SIZE, _Alignof(TextMessage));
 
     // Receive everything but the text so we can know the text's size and act accordingly
-    s32 nrecv = recv(fd, message, TEXTMESSAGE_SIZE, 0);
+    s32 nrecv = recv(fd, message, TEXTMESSAGE_SIZE, MSG_WAITALL);
     assert(nrecv != -1);
     assert(nrecv == TEXTMESSAGE_SIZE);
 
@@ -211,7 +465,7 @@ recvTextMessage(Arena* msgsArena, u32 fd)
     u32 text_size = message->len * sizeof(*message->text);
     ArenaPush(msgsArena, text_size);
 
-    nrecv = recv(fd, (u8*)&message->text, text_size, 0);
+    nrecv = recv(fd, (u8*)&message->text, text_size, MSG_WAITALL);
     assert(nrecv != -1);
     assert(nrecv == (s32)(message->len * sizeof(*message->text)));
 
@@ -234,6 +488,15 @@ getMessageSize(HeaderType type)
     case HEADER_TYPE_INTRODUCTION: size = sizeof(IntroductionMessage); break;
     case HEADER_TYPE_PRESENCE: size = sizeof(PresenceMessage); break;
     case HEADER_TYPE_ID: size = sizeof(IDMessage); break;
+    case HEADER_TYPE_IDLIST: size = sizeof(IDListMessage); break;
+    case HEADER_TYPE_SESSION: size = sizeof(SessionMessage); break;
+    case HEADER_TYPE_RESUME: size = sizeof(ResumeMessage); break;
+    case HEADER_TYPE_ROOM: size = sizeof(RoomMessage); break;
+    case HEADER_TYPE_ACK: size = sizeof(AckMessage); break;
+    case HEADER_TYPE_ROSTER: size = sizeof(RosterMessage); break;
+    case HEADER_TYPE_BATCH: size = sizeof(BatchMessage); break;
+    case HEADER_TYPE_PING:
+    case HEADER_TYPE_PONG: size = sizeof(PingMessage); break;
     default: assert(0);
     }
     return size;
@@ -242,7 +505,7 @@ getMessageSize(HeaderType type)
 s32
 recvAnyMessageType(s32 fd, HeaderMessage* header, void *anyMessage, HeaderType type)
 {
-    s32 nrecv = recv(fd, header, sizeof(*header), 0);
+    s32 nrecv = recv(fd, header, sizeof(*header), MSG_WAITALL);
     if (nrecv == -1 || nrecv == 0)
         return nrecv;
     assert(nrecv == sizeof(*header));
@@ -255,6 +518,14 @@ recvAnyMessageType(s32 fd, HeaderMessage* header, void *anyMessage, HeaderType t
     case HEADER_TYPE_INTRODUCTION:
     case HEADER_TYPE_PRESENCE:
     case HEADER_TYPE_ID:
+    case HEADER_TYPE_IDLIST:
+    case HEADER_TYPE_SESSION:
+    case HEADER_TYPE_RESUME:
+    case HEADER_TYPE_ROOM:
+    case HEADER_TYPE_ACK:
+    case HEADER_TYPE_ROSTER:
+    case HEADER_TYPE_PING:
+    case HEADER_TYPE_PONG:
         size = getMessageSize(header->type);
         break;
     case HEADER_TYPE_TEXT:
@@ -266,7 +537,7 @@ recvAnyMessageType(s32 fd, HeaderMessage* header, void *anyMessage, HeaderType t
     }
     assert(header->type == type);
 
-    nrecv = recv(fd, anyMessage, size, 0);
+    nrecv = recv(fd, anyMessage, size, MSG_WAITALL);
     assert(nrecv != -1);
     assert(nrecv == size);
 
@@ -277,8 +548,8 @@ recvAnyMessageType(s32 fd, HeaderMessage* header, void *anyMessage, HeaderType t
 Message
 recvAnyMessage(Arena* arena, s32 fd)
 {
-    HeaderMessage* header = ArenaPush(arena, sizeof(*header));
-    s32 nrecv = recv(fd, header, sizeof(*header), 0);
+    HeaderMessage* header = PushStruct(arena, HeaderMessage);
+    s32 nrecv = recv(fd, header, sizeof(*header), MSG_WAITALL);
     assert(nrecv != -1);
     assert(nrecv == sizeof(*header));
 
@@ -299,10 +570,19 @@ recvAnyMessage(Arena* arena, s32 fd)
     }
 
     void* message = ArenaPush(arena, size);
-    nrecv = recv(fd, message, size, 0);
+    nrecv = recv(fd, message, size, MSG_WAITALL);
     assert(nrecv != -1);
     assert(nrecv == size);
 
+    // Entries follow the BatchMessage, see batchRead()
+    if (header->type == HEADER_TYPE_BATCH)
+    {
+        BatchMessage* batch = message;
+        void* entries = ArenaPush(arena, batch->size);
+        nrecv = recv(fd, entries, batch->size, MSG_WAITALL);
+        assert(nrecv == (s32)batch->size);
+    }
+
     Message result;
     result.header = header;
     result.message = message;
@@ -324,33 +604,221 @@ waitForMessageType(Arena* arena, Arena* queueArena, u32 fd, HeaderType type)
     return message;
 }
 
+// Returns difference with its sign moved to the lowest bit so that small negative differences
+// become small varints.  See "Batches".
+u64
+zigzag(u64 difference)
+{
+    return (difference << 1) ^ (u64)((s64)difference >> 63);
+}
+
+// Returns the difference that was encoded with zigzag()
+u64
+unzigzag(u64 value)
+{
+    return (value >> 1) ^ -(value & 1);
+}
+
+// Write value to at as a varint.  See "Batches".
+// Returns the number of bytes written, at most VARINT_MAX.
+u32
+putVarint(u8* at, u64 value)
+{
+    u32 len = 0;
+    while (value >= 0x80)
+    {
+        at[len++] = (u8)value | 0x80;
+        value >>= 7;
+    }
+    at[len++] = (u8)value;
+    return len;
+}
+
+// Read a varint at *at that ends before end and move *at past it.
+// Returns the value, 0 with *at set to end if the varint does not end before end.
+u64
+getVarint(u8** at, u8* end)
+{
+    u64 value = 0;
+    for (u32 shift = 0; *at < end && shift < 64; shift += 7)
+    {
+        u8 byte = *(*at)++;
+        value |= (u64)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    *at = end;
+    return 0;
+}
+
+// Returns the most bytes the notification header and message take as an entry in a batch
+u32
+batchEntryMax(HeaderMessage* header, void* message)
+{
+    u32 size = 1 + 2 * VARINT_MAX;
+    if (header->type == HEADER_TYPE_TEXT)
+    {
+        TextMessage* text = message;
+        size += 4 * VARINT_MAX + text->len * sizeof(*text->text);
+    }
+    else
+        size += sizeof(PresenceMessage);
+    return size;
+}
+
+// Start a BatchMessage on arena after the notification with sequence number prev.
+void
+batchBegin(Batch* batch, Arena* arena, u64 prev)
+{
+    HeaderMessage header = HEADER_INIT(HEADER_TYPE_BATCH);
+    header.prev = prev;
+    memcpy(ArenaPush(arena, sizeof(header)), &header, sizeof(header));
+    
+    batch->at = ArenaPush(arena, sizeof(batch->message));
+    memset(&batch->message, 0, sizeof(batch->message));
+    memcpy(batch->at, &batch->message, sizeof(batch->message));
+    batch->seq = 0;
+    batch->id = 0;
+    batch->timestamp = 0;
+}
+
+// Append the notification header and message to the batch started on arena.  The caller makes
+// sure it fits in BATCH_SIZE, see batchEntryMax().
+void
+batchPush(Batch* batch, Arena* arena, HeaderMessage* header, void* message)
+{
+    u64 pos = arena->pos;
+    u8* start = ArenaPush(arena, batchEntryMax(header, message));
+    u8* at = start;
+    
+    *at++ = header->type;
+    at += putVarint(at, zigzag(header->seq - batch->seq));
+    at += putVarint(at, zigzag(header->id - batch->id));
+    batch->seq = header->seq;
+    batch->id = header->id;
+    
+    if (header->type == HEADER_TYPE_TEXT)
+    {
+        TextMessage* text = message;
+        at += putVarint(at, zigzag(text->timestamp - batch->timestamp));
+        at += putVarint(at, text->room);
+        at += putVarint(at, text->to);
+        at += putVarint(at, text->len);
+        u32 size = text->len * sizeof(*text->text);
+        memcpy(at, &text->text, size);
+        at += size;
+        batch->timestamp = text->timestamp;
+    }
+    else
+    {
+        assert(header->type == HEADER_TYPE_PRESENCE);
+        memcpy(at, message, sizeof(PresenceMessage));
+        at += sizeof(PresenceMessage);
+    }
+    
+    ArenaPopTo(arena, pos + (at - start));
+    batch->message.count++;
+    batch->message.size += at - start;
+    memcpy(batch->at, &batch->message, sizeof(batch->message));
+}
+
+// Start reading the entries received after header and message.
+void
+batchRead(BatchReader* reader, HeaderMessage* header, BatchMessage* message, u8* entries)
+{
+    reader->at = entries;
+    reader->end = entries + message->size;
+    reader->left = message->count;
+    reader->prev = header->prev;
+    reader->seq = 0;
+    reader->id = 0;
+    reader->timestamp = 0;
+}
+
+// Decode the next entry in reader to a header followed by its message on arena.
+// Returns the header, 0 when there are no entries left or the entry is malformed.
+HeaderMessage*
+batchNext(BatchReader* reader, Arena* arena)
+{
+    if (!reader->left || reader->at >= reader->end) return 0;
+    reader->left--;
+    
+    u64 pos = arena->pos;
+    HeaderMessage* header = PushStruct(arena, HeaderMessage);
+    *header = (HeaderMessage)HEADER_INIT(*reader->at++);
+    reader->seq += unzigzag(getVarint(&reader->at, reader->end));
+    reader->id += unzigzag(getVarint(&reader->at, reader->end));
+    header->seq = reader->seq;
+    header->id = reader->id;
+    header->prev = reader->prev;
+    reader->prev = reader->seq;
+    
+    u32 ok = 0;
+    if (header->type == HEADER_TYPE_TEXT)
+    {
+        TextMessage* text = ArenaPushAligned(arena, TEXTMESSAGE_SIZE, _Alignof(TextMessage));
+        reader->timestamp += unzigzag(getVarint(&reader->at, reader->end));
+        text->timestamp = reader->timestamp;
+        text->room = getVarint(&reader->at, reader->end);
+        text->to = getVarint(&reader->at, reader->end);
+        text->len = getVarint(&reader->at, reader->end);
+        u32 size = text->len * sizeof(*text->text);
+        ok = ((u64)(reader->end - reader->at) >= size);
+        if (ok)
+            memcpy(ArenaPush(arena, size), reader->at, size);
+        reader->at += size;
+    }
+    else if (header->type == HEADER_TYPE_PRESENCE)
+    {
+        ok = ((u64)(reader->end - reader->at) >= sizeof(PresenceMessage));
+        if (ok)
+            memcpy(ArenaPush(arena, sizeof(PresenceMessage)), reader->at, sizeof(PresenceMessage));
+        reader->at += sizeof(PresenceMessage);
+    }
+    
+    if (!ok)
+    {
+        ArenaPopTo(arena, pos);
+        reader->left = 0;
+        return 0;
+    }
+    return header;
+}
+
 // Generic sending function for sending any type of message to fd
-// Returns number of bytes sent in message or -1 if there was an error.
+// Returns number of bytes sent in message or -1 if there was an error or the message was only
+// partly sent, the connection cannot be used after that.
 s32
 sendAnyMessage(u32 fd, HeaderMessage header, void* anyMessage)
 {
     s32 nsend_total;
+    HeaderType type = header.type;
     s32 nsend = send(fd, &header, sizeof(header), 0);
-    if (nsend == -1) return nsend;
+    if (nsend != sizeof(header)) return -1;
     LoggingF("sendAnyMessage (%d)|sending "HEADER_FMT"\n", fd, HEADER_ARG(header));
-    assert(nsend == sizeof(header));
     nsend_total = nsend;
 
     s32 size = 0;
-    switch (header.type)
+    switch (type)
     {
     case HEADER_TYPE_ERROR:
     case HEADER_TYPE_HISTORY:
     case HEADER_TYPE_INTRODUCTION:
     case HEADER_TYPE_PRESENCE:
     case HEADER_TYPE_ID:
-        size = getMessageSize(header.type);
+    case HEADER_TYPE_IDLIST:
+    case HEADER_TYPE_SESSION:
+    case HEADER_TYPE_RESUME:
+    case HEADER_TYPE_ROOM:
+    case HEADER_TYPE_ACK:
+    case HEADER_TYPE_ROSTER:
+    case HEADER_TYPE_PING:
+    case HEADER_TYPE_PONG:
+        size = getMessageSize(type);
         break;
     case HEADER_TYPE_TEXT:
     {
         nsend = send(fd, anyMessage, TEXTMESSAGE_SIZE, 0);
-        assert(nsend != -1);
-        assert(nsend == TEXTMESSAGE_SIZE);
+        if (nsend != TEXTMESSAGE_SIZE) return -1;
         nsend_total += nsend;
         // set size to remaning text size that should be sent
         TextMessage* message = (TextMessage*)anyMessage;
@@ -365,8 +833,7 @@ sendAnyMessage(u32 fd, HeaderMessage header, void* anyMessage)
     }
 
     nsend = send(fd, anyMessage, size, 0);
-    if (nsend == -1) return nsend;
-    assert(nsend == size);
+    if (nsend != size) return -1;
     nsend_total += nsend;
 
     return nsend_total;
@@ -1,12 +1,19 @@
+#define _GNU_SOURCE // accept4
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <string.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Assertion macro */
@@ -30,6 +37,12 @@ raise(SIGTRAP); \
 #define ARENA_IMPL
 #include "arena.h"
 #undef ARENA_IMPL
+#define POOL_IMPL
+#include "pool.h"
+#undef POOL_IMPL
+#define TIMER_IMPL
+#include "timer.h"
+#undef TIMER_IMPL
 #include "protocol.h"
 
 /* Configuration options */
@@ -37,14 +50,85 @@ raise(SIGTRAP); \
 #define TIMEOUT 60 * 1000
 // max pending connections
 #define MAX_CONNECTIONS 1600
-// Get number of connections from arena position
-// NOTE: this is somewhat wrong, because of when disconnections happen
+// Get number of pollfds from arena position, closed connections are removed by
+// compactConnections()
 #define FDS_SIZE (fdsArena.pos / sizeof(struct pollfd))
-#define CLIENTS_SIZE (clientsArena.pos / sizeof(Client))
+// Maximum number of registered clients
+#define CLIENTS_MAX (1 << 20)
 
 #define IMPORT_ID 1
-// Where to save clients
+// Time in milliseconds rejected clients are asked to wait before connecting again
+#define RETRY_AFTER 2000
+// Maximum number of connections accepted on one wakeup, so established clients are served
+// in between
+#define ACCEPT_BATCH 64
+// New connections allowed per second from one address, and how many can be made at once
+#define ACCEPT_RATE 5
+#define ACCEPT_BURST 10
+// Number of addresses tracked for ACCEPT_RATE, must be a power of two
+#define ACCEPT_BUCKETS 1024
+// Text messages and bytes of text allowed per second from one client, and how many can be
+// sent at once.  TEXT_BURST is also the largest text message that is accepted.
+#define MESSAGE_RATE 5
+#define MESSAGE_BURST 20
+#define TEXT_RATE Kilobytes(8)
+#define TEXT_BURST Kilobytes(32)
+// Number of rooms besides room 0 that can exist at once, must be a power of two
+#define ROOMS_MAX 256
+// Number of rooms one client can be in at once besides room 0
+#define ROOMS_JOINED 16
+// Size classes for received text messages, a message takes a buffer of the smallest class it
+// fits in.  Larger texts than TEXT_BURST are not accepted.  See recvBuffer().
+#define BUFFER_SMALL 256
+#define BUFFER_MEDIUM Kilobytes(4)
+#define BUFFER_LARGE (offsetof(MessageBuffer, text) + TEXT_BURST)
+// Number of notifications kept for resuming sessions
+#define RING_SIZE 4096
+// Number of notifications kept track of in the messages file, must be a power of two and at
+// least RING_SIZE.  See MessageRing.
+#define LOG_SIZE 65536
+// Size of the messages file, once full it is written from the start again.  It fits the texts of
+// a full ring so a new server can load them, see takeOver().
+#define LOG_BYTES ((u64)(RING_SIZE + 1) * (sizeof(HeaderMessage) + TEXT_BURST))
+// Time in milliseconds a client has to resume its session before others are notified of its
+// disconnection
+#define SESSION_GRACE 5000
+// Time in milliseconds presence changes are collected before they are sent, see
+// queuePresence()
+#define PRESENCE_WINDOW 250
+// Length of a tick in milliseconds for timers, see TimerWheel
+#define TIMER_TICK 1000
+// Time in milliseconds without sending a text after which a client is reported as away
+#define AFK_TIMEOUT (5 * 60 * 1000)
+// TCP keepalive on client connections, probes start after KEEPALIVE_IDLE seconds without
+// traffic and are repeated every KEEPALIVE_INTERVAL seconds until KEEPALIVE_COUNT went
+// unanswered.  Heartbeats normally keep connections from being idle that long, see
+// "Heartbeats" in protocol.h.
+#define KEEPALIVE_IDLE 60
+#define KEEPALIVE_INTERVAL 10
+#define KEEPALIVE_COUNT 3
+// Time in milliseconds sent data may stay unacknowledged before the connection fails, so sends
+// to a vanished client do not pile up in its socket buffer
+#define SEND_TIMEOUT (HEARTBEAT_INTERVAL * HEARTBEAT_MISSED)
+// Maximum number of missed notifications sent to a client that comes back online
+#define INBOX_MAX 256
+// Maximum number of direct messages kept for a client while it is offline, older ones are
+// dropped
+#define DIRECT_MAX 256
+// Where to save clients, see ClientsHeader
 #define CLIENTS_FILE ".chatty_clients"
+// Where to write notifications for clients that are offline, see logMessage()
+#define MESSAGES_FILE ".chatty_messages"
+// Unix socket a new server connects to for taking over from the running one, see handOff()
+#define RESTART_SOCKET ".chatty_restart"
+// Maximum number of connections passed in one message during a handoff
+#define HANDOFF_FDS 64
+// Time in milliseconds clients are asked to wait before reconnecting when the server shuts
+// down, spread over RESTART_SPREAD so they do not all come back at once
+#define RESTART_RETRY 1000
+#define RESTART_SPREAD 10000
+// Time in milliseconds to wait for clients to close their connections when shutting down
+#define DRAIN_TIMEOUT 5000
 // Where to write logs
 #define LOGFILE "server.log"
 // Log to LOGFILE instead of stderr
@@ -53,59 +137,629 @@ raise(SIGTRAP); \
 // enum for indexing the fds array
 enum { FDS_STDIN = 0,
     FDS_SERVER,
+    FDS_RESTART, // Listening on RESTART_SOCKET
     FDS_CLIENTS };
 
-// Client information
+typedef struct Client Client;
+
+// Received text message shared by the ring, inboxes and fan-out.  It goes back to its pool when
+// the last reference is released, see releaseBuffer().
+typedef struct {
+    Pool* pool;
+    u32 refs;
+    TextMessage text; // the text continues past the end of the struct
+} MessageBuffer;
+
+// Pools for each size class of MessageBuffer
+typedef struct {
+    Pool small;  // BUFFER_SMALL
+    Pool medium; // BUFFER_MEDIUM
+    Pool large;  // BUFFER_LARGE
+} BufferPools;
+
+// Direct message waiting for its recipient to come online
+typedef struct InboxEntry InboxEntry;
+struct InboxEntry {
+    HeaderMessage header;
+    MessageBuffer* buffer; // referenced until sent
+    InboxEntry* next;
+};
+
+// Token bucket, allows rate units per second with bursts of up to burst units.  See
+// takeTokens().
+typedef struct {
+    u64 tokens; // available units, in thousandths
+    u64 time;   // time in milliseconds tokens were last refilled, 0 if never used
+} TokenBucket;
+
+// Connection to a client, see Connections
+typedef struct Connection Connection;
+struct Connection {
+    s32 fd;           // -1 once closed
+    Client* client;   // 0 until authenticated
+    Timer heartbeat;  // HEARTBEAT_INTERVAL after the last received message or sent ping
+    u32 missed;       // Pings sent since the last received message
+};
+
+// Connections are allocated from a pool so pointers to them stay valid while the pollfds in fds
+// are kept dense.  fds[i] belongs to polled[i].
+typedef struct {
+    Pool pool;
+    Connection* polled[FDS_CLIENTS + MAX_CONNECTIONS];
+    u32 count; // connections in fds, including ones closed since the last compaction
+} Connections;
+
+// Client information only needed when handling that one client
 typedef struct {
     u8 author[AUTHOR_LEN]; // matches author property on other message types
+    u64 token;             // Session token, see "Sessions" in protocol.h
+    u64 detached;          // Time the connection was lost, 0 when not waiting for a resume
+    TokenBucket messages;  // MESSAGE_RATE
+    TokenBucket text;      // TEXT_RATE
+    u32 dropped;           // Messages that were not forwarded because of rate limits
+    InboxEntry* inbox;     // Direct messages received while offline, oldest first
+    InboxEntry* inboxLast;
+    u32 ninbox;            // Entries in inbox, see DIRECT_MAX
+    u64 offline;           // Sequence number of the last notification before going offline
+    u64 acked;             // Sequence number of the last notification the client acknowledged
+    u32 presence;          // Index of its change in PresenceQueue plus one, 0 if none is pending
+    Timer afk;             // AFK_TIMEOUT after the last sent text while online
+    u32 away;              // Others were told the client is afk
+    u32 rooms;             // Rooms joined, see ROOMS_JOINED
+} ClientInfo;
+
+// Client information used by lookups and broadcasts, the rest is in info so that scans over
+// many clients touch as little memory as possible.
+struct Client {
     ID id;
-    struct pollfd* bifd;  // Index in fds array
-    struct pollfd* unifd; // Index in fds array
-} Client;
+    Connection* conn;      // 0 when offline
+    ClientInfo* info;
+    u64 sent;              // Sequence number of the last notification sent, see sendNotification()
+    u32 online;            // Index in OnlineClients plus one, 0 when offline
+};
+
+// Registered clients, the client with id and its info are at index id - 1.
+typedef struct {
+    Arena clients; // Client
+    Arena infos;   // ClientInfo
+} Registry;
+
+// Start of CLIENTS_FILE, it is followed by the author of each client in order of id.  Files
+// from before the header held whole Client structs and are refused.
+typedef struct {
+    u32 magic;   // CLIENTS_MAGIC
+    u32 version; // CLIENTS_VERSION
+} ClientsHeader;
+#define CLIENTS_MAGIC 0x53544c43 // "CLTS"
+#define CLIENTS_VERSION 2
 #define CLIENT_FMT "[%s](%lu)"
-#define CLIENT_ARG(client) client.author, client.id
+#define CLIENT_ARG(client) client.info->author, client.id
 
-typedef enum {
-    BIFD = 0,
-    UNIFD,
-} ClientFD;
+// Notification kept for resuming sessions
+typedef struct {
+    HeaderMessage header;
+    union {
+        PresenceMessage presence;
+        MessageBuffer* buffer; // referenced until the entry is overwritten
+    };
+} RingEntry;
+
+// Where a notification is in the messages file
+typedef struct {
+    u64 offset;  // in all bytes written to the file, see getLogEntry()
+    u32 size;    // of header and message, 0 if it was not written
+    RoomID room;
+    ID id;       // sender
+    u8 type;
+} LogEntry;
+
+// The last RING_SIZE notifications, the notification with sequence number seq is at
+// entries[seq % RING_SIZE].  Text messages are also written to a file so they can be sent to
+// clients that come back online, log has a LogEntry for the last LOG_SIZE notifications with
+// the one for seq at log[seq % LOG_SIZE].  The file is reused as a ring of LOG_BYTES.
+typedef struct {
+    RingEntry entries[RING_SIZE];
+    u64 seq; // sequence number of the last notification
+    LogEntry log[LOG_SIZE];
+    s32 logfd;
+    u64 logSize; // bytes written to logfd, it is at logSize % LOG_BYTES in the file
+} MessageRing;
+
+// Clients that have a connection, in no particular order.  Broadcasts go through this list so
+// they do not touch offline clients.  See setOnline().
+typedef struct {
+    Client* clients[MAX_CONNECTIONS];
+    u32 count;
+} OnlineClients;
+
+// Clients that joined a room, see "Rooms" in protocol.h
+typedef struct {
+    RoomID id; // 0 if unused
+    u32 count;
+    Client* members[MAX_CONNECTIONS]; // dense, a leaving member is replaced by the last one
+} Room;
+
+// Presence change waiting to be sent, see queuePresence()
+typedef struct {
+    Client* client;
+    HeaderMessage header;
+    PresenceMessage message;
+} PendingPresence;
+
+// Presence changes collected during PRESENCE_WINDOW, so that many clients connecting or
+// disconnecting at once cost each online client one batch instead of a frame per change.  A
+// client has at most one pending change.
+typedef struct {
+    Arena entries; // PendingPresence
+    u64 start;     // time the first pending change was queued
+} PresenceQueue;
+
+// Client that lost its connection at time
+typedef struct {
+    ID id;
+    u64 time;
+} Detached;
+
+// Clients that lost their connection ordered by time, because SESSION_GRACE is the same for
+// every client the first one is always the first to expire.
+typedef struct {
+    Detached entries[MAX_CONNECTIONS];
+    u32 head;
+    u32 len;
+} DetachedQueue;
+
+// Token bucket limiting the rate of new connections from one address
+typedef struct {
+    u32 addr; // IPv4 address, 0 if unused
+    TokenBucket bucket;
+} AcceptBucket;
+
+// Counters for messages the server refused to forward
+typedef struct {
+    u64 droppedMessages;
+    u64 droppedBytes;
+} Metrics;
+
+// Start of a handoff to a new server, the listening socket and the messages file are passed
+// with it.  It is followed by size bytes with
+// - the used LogEntries of the MessageRing
+// - the entries of the MessageRing
+// - a HandoffClient for each registered client
+// - the Detached clients in order
+// - a HandoffRoom for each room followed by the ids of its members
+// - a HandoffInbox for each direct message followed by its TextMessage
+// Then come the connections in HandoffConnections messages.  See handOff().
+typedef struct {
+    u32 nclients; // the new server must have imported the same clients
+    u64 seq;
+    u64 logSize;
+    u32 ndetached;
+    u32 nrooms;
+    u32 ninbox;
+    u32 nconnections;
+    u64 size;
+} HandoffState;
+
+// Session of a registered client
+typedef struct {
+    u64 token;
+    u64 detached;
+    u64 offline;
+    u64 acked;
+    u64 sent;
+    u32 away;
+} HandoffClient;
+
+typedef struct {
+    RoomID id;
+    u32 count;
+} HandoffRoom;
+
+typedef struct {
+    ID recipient;
+    HeaderMessage header;
+} HandoffInbox;
+
+// Connections passed in one message, ids[i] is the client of the i-th file descriptor or 0
+typedef struct {
+    u32 count;
+    ID ids[HANDOFF_FDS];
+} HandoffConnections;
 
 // TODO: remove global variable
 // For handing out new ids to connections.
 // Start at 1 because this makes 0 an invalid client id.
 global_variable u32 nclients = 1;
+global_variable Metrics metrics = {0};
+// Set by SIGINT and SIGTERM to shut down, see drainServer()
+global_variable volatile sig_atomic_t stopRequested = 0;
 
-// Returns client matching id in clients nclients number of clients.
+// Returns client matching id in clients nclients number of clients.  Clients are stored in
+// the order their ids were handed out so the client with id is at clients[id - 1].
 // Returns 0 if no client was found or if id was 0.
 Client*
 getClientByID(Client* clients, u32 nclients, ID id)
 {
-    if (!id) return 0;
+    if (!id || id >= nclients) return 0;
     
-    for (u32 i = 0; i < nclients; i++)
-	{
-        if (clients[i].id == id)
-            return clients + i;
+    assert(clients[id - 1].id == id);
+    return clients + id - 1;
+}
+
+// Register a client with author in registry under the next id.
+// Returns the new client.
+Client*
+addClient(Registry* registry, u8* author)
+{
+    Client* client = PushStruct(&registry->clients, Client);
+    ClientInfo* info = PushStructZero(&registry->infos, ClientInfo);
+    memcpy(info->author, author, AUTHOR_LEN);
+    
+    client->id = nclients++;
+    client->conn = 0;
+    client->info = info;
+    client->sent = 0;
+    client->online = 0;
+    return client;
+}
+
+// Returns monotonic time in milliseconds
+u64
+getTimeMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Refill bucket up to burst at rate units per second for the time passed until now.
+// Returns 0 if cost units are available, otherwise the time in milliseconds until they are.
+u32
+refillTokens(TokenBucket* bucket, u32 cost, u32 rate, u32 burst, u64 now)
+{
+    if (!bucket->time)
+        bucket->tokens = (u64)burst * 1000;
+    else
+        bucket->tokens += (now - bucket->time) * rate; // rate per second is thousandths per ms
+    
+    if (bucket->tokens > (u64)burst * 1000)
+        bucket->tokens = (u64)burst * 1000;
+    bucket->time = now;
+    
+    if (bucket->tokens < (u64)cost * 1000)
+        return ((u64)cost * 1000 - bucket->tokens + rate - 1) / rate;
+    return 0;
+}
+
+// Take cost units from bucket at time now, see refillTokens().
+// Returns 0 if they were taken, otherwise the time in milliseconds until they are available.
+u32
+takeTokens(TokenBucket* bucket, u32 cost, u32 rate, u32 burst, u64 now)
+{
+    u32 wait = refillTokens(bucket, cost, rate, burst, now);
+    if (!wait)
+        bucket->tokens -= (u64)cost * 1000;
+    return wait;
+}
+
+// Take a token from the bucket of addr in buckets at time now.  Addresses sharing a bucket
+// evict each other, the newcomer starts with a full bucket.
+// Returns 0 if the connection can be accepted, otherwise the time in milliseconds until it
+// could be.
+u32
+admitAddress(AcceptBucket* buckets, u32 addr, u64 now)
+{
+    AcceptBucket* entry = buckets + ((addr * 2654435769u) >> 22) % ACCEPT_BUCKETS;
+    if (entry->addr != addr)
+    {
+        entry->addr = addr;
+        entry->bucket.time = 0;
     }
+    
+    return takeTokens(&entry->bucket, 1, ACCEPT_RATE, ACCEPT_BURST, now);
+}
+
+// Charge client for sending a text message of size bytes at time now.
+// Returns 0 if the message may be forwarded, otherwise the time in milliseconds until it could
+// be.
+u32
+limitClient(Client* client, u32 size, u64 now)
+{
+    u32 waitMessages = refillTokens(&client->info->messages, 1, MESSAGE_RATE, MESSAGE_BURST, now);
+    u32 waitText = refillTokens(&client->info->text, size, TEXT_RATE, TEXT_BURST, now);
+    if (waitMessages || waitText)
+        return (waitMessages > waitText) ? waitMessages : waitText;
+    
+    client->info->messages.tokens -= 1000;
+    client->info->text.tokens -= (u64)size * 1000;
     return 0;
 }
 
-// Returns client matching fd in clients nclients number of clients.
-// Returns 0 if no clients was found or if fd was -1.
-Client* 
-getClientByFD(Client* clients, u32 nclients, s32 fd)
+// Send an ErrorMessage of type on fd as the answer to request about id, request is 0 when it
+// is not an answer.  The header is built from scratch so nothing of the received one leaks
+// into it.
+// Returns the number of bytes sent or -1.
+s32
+sendError(s32 fd, u32 request, ID id, ErrorType type, u32 retry)
 {
-    if (fd == -1) return 0;
+    HeaderMessage header = HEADER_INIT(HEADER_TYPE_ERROR);
+    header.request = request;
+    header.id = id;
+    ErrorMessage message = {.type = type, .retry = retry};
+    return sendAnyMessage(fd, header, &message);
+}
+
+// Refuse connection on fd telling the client to retry after retry milliseconds, then close it.
+void
+rejectConnection(s32 fd, u32 retry)
+{
+    sendError(fd, 0, 0, ERROR_TYPE_TOOMANYCONNECTIONS, retry);
+    close(fd);
+}
+
+// Returns the slot in rooms where the search for the room with id starts.
+u32
+roomSlot(RoomID id)
+{
+    return (id * 2654435769u) & (ROOMS_MAX - 1);
+}
+
+// Returns room with id in rooms, ROOMS_MAX number of rooms.  If it does not exist and create
+// is set it is created.
+// Returns 0 if the room was not found or there is no space to create it.
+Room*
+getRoom(Room* rooms, RoomID id, u32 create)
+{
+    assert(id);
     
-    for (u32 i = 0; i < nclients; i++)
+    u32 slot = roomSlot(id);
+    for (u32 i = 0; i < ROOMS_MAX; i++)
     {
-        if ((clients[i].unifd && clients[i].unifd->fd == fd) ||
-            (clients[i].bifd && clients[i].bifd->fd == fd))
-            return clients + i;
+        Room* room = rooms + ((slot + i) & (ROOMS_MAX - 1));
+        if (room->id == id)
+            return room;
+        if (!room->id)
+        {
+            if (!create) return 0;
+            room->id = id;
+            room->count = 0;
+            return room;
+        }
     }
     return 0;
 }
 
+// Returns index of client in room's members or -1 if it is not a member.
+s32
+findRoomMember(Room* room, Client* client)
+{
+    for (u32 i = 0; i < room->count; i++)
+    {
+        if (room->members[i] == client)
+            return i;
+    }
+    return -1;
+}
+
+// Free room in rooms.  Rooms after it that were pushed further from their slot by getRoom()
+// are moved back so that searches for them do not stop at the hole.
+void
+freeRoom(Room* rooms, Room* room)
+{
+    u32 hole = room - rooms;
+    for (u32 at = (hole + 1) & (ROOMS_MAX - 1); rooms[at].id; at = (at + 1) & (ROOMS_MAX - 1))
+    {
+        // Only move rooms whose slot is not between the hole and where they are
+        u32 slot = roomSlot(rooms[at].id);
+        if (((at - slot) & (ROOMS_MAX - 1)) < ((at - hole) & (ROOMS_MAX - 1))) continue;
+        
+        rooms[hole].id = rooms[at].id;
+        rooms[hole].count = rooms[at].count;
+        memcpy(rooms[hole].members, rooms[at].members, rooms[at].count * sizeof(*rooms[at].members));
+        hole = at;
+    }
+    rooms[hole].id = 0;
+    rooms[hole].count = 0;
+}
+
+// Add client to the members of the room with id in rooms, the room is created if it does not
+// exist yet.
+// Returns ERROR_TYPE_TOOMANYROOMS if the room cannot be created, is full or client already
+// joined ROOMS_JOINED rooms, otherwise ERROR_TYPE_SUCCESS.
+ErrorType
+joinRoom(Room* rooms, RoomID id, Client* client)
+{
+    Room* room = getRoom(rooms, id, 0);
+    if (room && findRoomMember(room, client) != -1) return ERROR_TYPE_SUCCESS;
+    if (client->info->rooms == ROOMS_JOINED) return ERROR_TYPE_TOOMANYROOMS;
+    
+    if (!room)
+        room = getRoom(rooms, id, 1);
+    if (!room || room->count == MAX_CONNECTIONS) return ERROR_TYPE_TOOMANYROOMS;
+    
+    room->members[room->count++] = client;
+    client->info->rooms++;
+    return ERROR_TYPE_SUCCESS;
+}
+
+// Remove client from the members of the room with id in rooms, the room is freed when its last
+// member leaves.
+// Returns ERROR_TYPE_NOTFOUND if client was not a member, otherwise ERROR_TYPE_SUCCESS.
+ErrorType
+leaveRoom(Room* rooms, RoomID id, Client* client)
+{
+    Room* room = getRoom(rooms, id, 0);
+    s32 index = room ? findRoomMember(room, client) : -1;
+    if (index == -1) return ERROR_TYPE_NOTFOUND;
+    
+    room->members[index] = room->members[--room->count];
+    client->info->rooms--;
+    if (!room->count)
+        freeRoom(rooms, room);
+    return ERROR_TYPE_SUCCESS;
+}
+
+// Returns a buffer with one reference from the smallest class in buffers that fits a
+// TextMessage with text_size bytes of text, 0 if the class has no buffers left.
+MessageBuffer*
+allocBuffer(BufferPools* buffers, u32 text_size)
+{
+    u32 size = offsetof(MessageBuffer, text) + TEXTMESSAGE_SIZE + text_size;
+    assert(size <= BUFFER_LARGE);
+    Pool* pool = &buffers->large;
+    if (size <= BUFFER_SMALL)
+        pool = &buffers->small;
+    else if (size <= BUFFER_MEDIUM)
+        pool = &buffers->medium;
+    
+    MessageBuffer* buffer = PoolPush(pool);
+    if (!buffer) return 0;
+    buffer->pool = pool;
+    buffer->refs = 1;
+    return buffer;
+}
+
+// Read size bytes from fd and throw them away.
+void
+discardBytes(s32 fd, u32 size)
+{
+    u8 scratch[Kilobytes(4)];
+    while (size)
+    {
+        u32 chunk = (size < sizeof(scratch)) ? size : sizeof(scratch);
+        s32 nrecv = recv(fd, scratch, chunk, MSG_WAITALL);
+        if (nrecv <= 0) return;
+        size -= nrecv;
+    }
+}
+
+// Receive a TextMessage from fd into a buffer from buffers, see allocBuffer().  size is set to
+// the size of the message.  Messages larger than TEXT_BURST or without a free buffer are read
+// and discarded.
+// Returns the buffer with one reference or 0 if the message was discarded.
+MessageBuffer*
+recvBuffer(BufferPools* buffers, s32 fd, u32* size)
+{
+    TextMessage message;
+    s32 nrecv = recv(fd, &message, TEXTMESSAGE_SIZE, MSG_WAITALL);
+    assert(nrecv == TEXTMESSAGE_SIZE);
+    
+    u32 text_size = message.len * sizeof(*message.text);
+    *size = TEXTMESSAGE_SIZE + text_size;
+    MessageBuffer* buffer = 0;
+    if (*size <= TEXT_BURST)
+        buffer = allocBuffer(buffers, text_size);
+    if (!buffer)
+    {
+        discardBytes(fd, text_size);
+        return 0;
+    }
+    memcpy(&buffer->text, &message, TEXTMESSAGE_SIZE);
+    
+    nrecv = recv(fd, &buffer->text.text, text_size, MSG_WAITALL);
+    assert(nrecv == (s32)text_size);
+    
+    return buffer;
+}
+
+// Add a reference to buffer.
+// Returns buffer.
+MessageBuffer*
+retainBuffer(MessageBuffer* buffer)
+{
+    buffer->refs++;
+    return buffer;
+}
+
+// Drop a reference to buffer, the last one gives it back to its pool.
+void
+releaseBuffer(MessageBuffer* buffer)
+{
+    assert(buffer->refs);
+    if (--buffer->refs) return;
+    PoolFree(buffer->pool, buffer);
+}
+
+// Add a LogEntry for header to ring's log, text is written with header after the last text in
+// ring's file as they are sent on a connection.  text is 0 for other notifications.
+void
+logMessage(MessageRing* ring, HeaderMessage* header, TextMessage* text)
+{
+    LogEntry* entry = ring->log + (header->seq % LOG_SIZE);
+    entry->offset = 0;
+    entry->size = 0;
+    entry->room = 0;
+    entry->id = header->id;
+    entry->type = header->type;
+    if (!text) return;
+    
+    struct iovec iov[3] = {
+        {header, sizeof(*header)},
+        {text, TEXTMESSAGE_SIZE},
+        {&text->text, text->len * sizeof(*text->text)},
+    };
+    u32 size = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+    // A text does not wrap around the end of the file
+    if (ring->logSize % LOG_BYTES + size > LOG_BYTES)
+        ring->logSize += LOG_BYTES - ring->logSize % LOG_BYTES;
+    s32 nwrite = pwritev(ring->logfd, iov, 3, ring->logSize % LOG_BYTES);
+    assert(nwrite == (s32)size);
+    
+    entry->offset = ring->logSize;
+    entry->size = size;
+    entry->room = text->room;
+    ring->logSize += size;
+}
+
+// Returns the LogEntry for notification seq in ring, 0 if it is not kept anymore because it is
+// older than the last LOG_SIZE notifications or its text was written over.
+LogEntry*
+getLogEntry(MessageRing* ring, u64 seq)
+{
+    if (!seq || seq > ring->seq || ring->seq - seq >= LOG_SIZE) return 0;
+    
+    LogEntry* entry = ring->log + (seq % LOG_SIZE);
+    if (entry->size && entry->offset + LOG_BYTES < ring->logSize) return 0;
+    return entry;
+}
+
+// Assign the next sequence number to header and keep message in ring so it can be sent again to
+// clients that resume their session.  For text messages message is a MessageBuffer, the ring
+// keeps a reference to it.
+void
+recordMessage(MessageRing* ring, HeaderMessage* header, void* message)
+{
+    ring->seq++;
+    header->seq = ring->seq;
+    MessageBuffer* buffer = (header->type == HEADER_TYPE_TEXT) ? message : 0;
+    logMessage(ring, header, buffer ? &buffer->text : 0);
+    
+    RingEntry* entry = ring->entries + (ring->seq % RING_SIZE);
+    if (entry->header.seq && entry->header.type == HEADER_TYPE_TEXT)
+        releaseBuffer(entry->buffer);
+    
+    entry->header = *header;
+    switch (header->type)
+    {
+    case HEADER_TYPE_PRESENCE: entry->presence = *(PresenceMessage*)message; break;
+    case HEADER_TYPE_TEXT: entry->buffer = retainBuffer(buffer); break;
+    default: assert(0);
+    }
+}
+
+// Send notification header and anyMessage on client's connection with the sequence number of the
+// notification sent before it as prev.  See "Acknowledgements" in protocol.h.
+// Returns the number of bytes sent or -1.
+s32
+sendNotification(Client* client, HeaderMessage header, void* anyMessage)
+{
+    header.prev = client->sent;
+    s32 nsend = sendAnyMessage(client->conn->fd, header, anyMessage);
+    if (nsend != -1)
+        client->sent = header.seq;
+    return nsend;
+}
+
 // Print TextMessage prettily
 void
 printTextMessage(TextMessage* message, Client* client, u8 wide)
@@ -116,156 +770,748 @@ printTextMessage(TextMessage* message, Client* client, u8 wide)
     if (wide)
 	{
         setlocale(LC_ALL, "");
-        wprintf(L"TextMessage: %s [%s] %ls\n", timestamp, client->author, (wchar_t*)&message->text);
+        wprintf(L"TextMessage: %s [%s] %ls\n", timestamp, client->info->author, (wchar_t*)&message->text);
     } else {
         u8 str[message->len];
         wcstombs((char*)str, (wchar_t*)&message->text, message->len * sizeof(*message->text));
-        LoggingF("TextMessage: %s [%s] (%d)%s\n", timestamp, client->author, message->len, str);
+        LoggingF("TextMessage: %s [%s] (%d)%s\n", timestamp, client->info->author, message->len, str);
     }
 }
 
-// Send header and anyMessage to each connection in fds that is nfds number of connections except
-// for connfd.
-// Does not send if pollfd is not set or pollfd->fd is -1.
-// Type will filter out only connections matching the type.
+// Add client to online if it is not already in it.
 void
-sendToOthers(Client* clients, u32 nclients, Client* client, ClientFD type, HeaderMessage* header, void* anyMessage)
+setOnline(OnlineClients* online, Client* client)
 {
-    s32 nsend, fd;
-    for (u32 i = 0; i < nclients - 1; i ++)
+    if (client->online) return;
+    
+    assert(online->count < MAX_CONNECTIONS);
+    online->clients[online->count++] = client;
+    client->online = online->count;
+}
+
+// Remove client from online by moving the last online client in its place.
+void
+setOffline(OnlineClients* online, Client* client)
+{
+    if (!client->online) return;
+    
+    Client* last = online->clients[--online->count];
+    online->clients[client->online - 1] = last;
+    last->online = client->online;
+    client->online = 0;
+}
+
+// Send header and anyMessage to each client in online except for client.
+// Does not send if the client's connection is closed.
+void
+sendToOthers(OnlineClients* online, Client* client, HeaderMessage* header, void* anyMessage)
+{
+    for (u32 i = 0; i < online->count; i++)
 	{
-        if (clients + i == client) continue;
+        Client* other = online->clients[i];
+        if (other == client || other->conn->fd == -1) continue;
+        
+        s32 nsend = sendNotification(other, *header, anyMessage);
+        LoggingF("sendToOthers "CLIENT_FMT"|%d<-%s %d bytes\n", CLIENT_ARG((*other)), other->conn->fd, headerTypeString(header->type), nsend);
+    }
+}
+
+// Returns the presence type that undoes type
+PresenceType
+oppositePresence(PresenceType type)
+{
+    switch (type)
+    {
+    case PRESENCE_TYPE_CONNECTED: return PRESENCE_TYPE_DISCONNECTED;
+    case PRESENCE_TYPE_DISCONNECTED: return PRESENCE_TYPE_CONNECTED;
+    case PRESENCE_TYPE_AFK: return PRESENCE_TYPE_BACK;
+    case PRESENCE_TYPE_BACK: return PRESENCE_TYPE_AFK;
+    default: assert(0); return type;
+    }
+}
+
+// Queue a presence change of type for client to be sent with the others in queue once
+// PRESENCE_WINDOW passed, see flushPresence().  When the opposite change is still pending both
+// cancel out, others never noticed.  Otherwise the pending change is replaced.
+void
+queuePresence(PresenceQueue* queue, Client* client, PresenceType type)
+{
+    PendingPresence* entries = queue->entries.addr;
+    u32 count = queue->entries.pos / sizeof(*entries);
+    
+    if (client->info->presence)
+    {
+        PendingPresence* entry = entries + client->info->presence - 1;
+        if (entry->message.type != oppositePresence(type))
+        {
+            entry->message.type = type;
+            return;
+        }
+        // Others still see the client as away from before it disconnected
+        if (type == PRESENCE_TYPE_CONNECTED && client->info->away)
+        {
+            LoggingF("Presence %s turned into back "CLIENT_FMT"\n", presenceTypeString(type), CLIENT_ARG((*client)));
+            entry->message.type = PRESENCE_TYPE_BACK;
+            client->info->away = 0;
+            return;
+        }
         
-        if (type == UNIFD)
+        LoggingF("Presence %s cancelled "CLIENT_FMT"\n", presenceTypeString(type), CLIENT_ARG((*client)));
+        PendingPresence* last = entries + count - 1;
+        last->client->info->presence = client->info->presence;
+        *entry = *last;
+        client->info->presence = 0;
+        ArenaPopTo(&queue->entries, (count - 1) * sizeof(*entries));
+        return;
+    }
+    
+    if (!count)
+        queue->start = getTimeMs();
+    PendingPresence* entry = PushStruct(&queue->entries, PendingPresence);
+    entry->client = client;
+    entry->header = (HeaderMessage)HEADER_INIT(HEADER_TYPE_PRESENCE);
+    entry->header.id = client->id;
+    entry->message.type = type;
+    memcpy(entry->message.author, client->info->author, AUTHOR_LEN);
+    client->info->presence = count + 1;
+}
+
+// Make the kernel notice when the peer on fd vanished, see KEEPALIVE_IDLE and SEND_TIMEOUT.
+void
+setKeepalive(s32 fd)
+{
+    s32 on = 1;
+    s32 idle = KEEPALIVE_IDLE;
+    s32 interval = KEEPALIVE_INTERVAL;
+    s32 count = KEEPALIVE_COUNT;
+    u32 timeout = SEND_TIMEOUT;
+    s32 err = setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    err |= setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    err |= setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    err |= setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    err |= setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+    if (err)
+        LoggingF("Could not set keepalive on (%d), errno: %d\n", fd, errno);
+}
+
+// Allocate a connection for fd and add a pollfd for it at the end of fdsArena.
+// Returns the new connection.
+Connection*
+addConnection(Connections* connections, Arena* fdsArena, s32 fd)
+{
+    assert(connections->count < MAX_CONNECTIONS);
+    Connection* connection = PoolPushStruct(&connections->pool, Connection);
+    connection->fd = fd;
+    connection->client = 0;
+    connection->heartbeat = (Timer){0};
+    connection->missed = 0;
+    
+    struct pollfd* pollfd = PushStruct(fdsArena, struct pollfd);
+    *pollfd = (struct pollfd){fd, POLLIN, 0};
+    connections->polled[pollfd - (struct pollfd*)fdsArena->addr] = connection;
+    connections->count++;
+    
+    return connection;
+}
+
+// Close connection, it is freed on the next compactConnections().
+void
+closeConnection(Connection* connection)
+{
+    if (connection->fd == -1) return;
+    
+    close(connection->fd);
+    connection->fd = -1;
+    TimerRemove(&connection->heartbeat);
+}
+
+// Free closed connections and remove their pollfds from fdsArena by moving the
+// last pollfd in their place.
+void
+compactConnections(Connections* connections, Arena* fdsArena)
+{
+    struct pollfd* fds = fdsArena->addr;
+    u32 nfds = fdsArena->pos / sizeof(*fds);
+    
+    for (u32 i = FDS_CLIENTS; i < nfds;)
+    {
+        Connection* connection = connections->polled[i];
+        if (connection->fd != -1)
         {
-            if (clients[i].unifd && clients[i].unifd->fd != -1)
-                fd = clients[i].unifd->fd;
-            else
-                continue;
+            i++;
+            continue;
         }
-        else if (type == BIFD)
+        
+        PoolFree(&connections->pool, connection);
+        connections->count--;
+        
+        nfds--;
+        fds[i] = fds[nfds];
+        connections->polled[i] = connections->polled[nfds];
+    }
+    
+    ArenaPopTo(fdsArena, nfds * sizeof(*fds));
+}
+
+// Disconnect a client by closing the matching file descriptors and removing it from online
+void
+disconnect(OnlineClients* online, Client* client)
+{
+    LoggingF("Disconnecting "CLIENT_FMT"\n", CLIENT_ARG((*client)));
+    if (client->conn)
+        closeConnection(client->conn);
+    client->conn = 0;
+    setOffline(online, client);
+    TimerRemove(&client->info->afk);
+}
+
+// Disconnects client, then let other clients know about the disconnection.
+void
+disconnectAndNotify(PresenceQueue* presence, OnlineClients* online, Client* client)
+{
+    disconnect(online, client);
+    client->info->detached = 0;
+    client->info->offline = client->info->acked;
+    queuePresence(presence, client, PRESENCE_TYPE_DISCONNECTED);
+}
+
+// Disconnect client that lost its connection, others are notified when it did not resume its
+// session within SESSION_GRACE.  See expireDetached().
+void
+detach(DetachedQueue* queue, PresenceQueue* presence, OnlineClients* online, Client* client)
+{
+    disconnect(online, client);
+    client->info->offline = client->info->acked;
+    
+    if (queue->len == MAX_CONNECTIONS)
+    {
+        client->info->detached = 0;
+        queuePresence(presence, client, PRESENCE_TYPE_DISCONNECTED);
+        return;
+    }
+    
+    client->info->detached = getTimeMs();
+    Detached* entry = queue->entries + ((queue->head + queue->len) % MAX_CONNECTIONS);
+    entry->id = client->id;
+    entry->time = client->info->detached;
+    queue->len++;
+}
+
+// Keep direct message in buffer with header for recipient until it authenticates again, see
+// sendInbox().  Entries come from inboxPool, when DIRECT_MAX are already waiting the oldest
+// one is dropped to make room.
+// Returns 0 if there was no entry left for the message.
+u32
+queueInbox(Pool* inboxPool, Client* recipient, HeaderMessage* header, MessageBuffer* buffer)
+{
+    ClientInfo* info = recipient->info;
+    InboxEntry* entry;
+    if (info->ninbox == DIRECT_MAX)
+    {
+        LoggingF("Inbox full, dropped oldest direct message for "CLIENT_FMT"\n", CLIENT_ARG((*recipient)));
+        entry = info->inbox;
+        info->inbox = entry->next;
+        if (!info->inbox)
+            info->inboxLast = 0;
+        info->ninbox--;
+        releaseBuffer(entry->buffer);
+    }
+    else
+    {
+        entry = PoolPushStruct(inboxPool, InboxEntry);
+        if (!entry) return 0;
+    }
+    entry->header = *header;
+    entry->buffer = retainBuffer(buffer);
+    entry->next = 0;
+    
+    if (info->inboxLast)
+        info->inboxLast->next = entry;
+    else
+        info->inbox = entry;
+    info->inboxLast = entry;
+    info->ninbox++;
+    return 1;
+}
+
+// Send the bytes in buffer on fd and empty it.
+// Returns -1 if sending failed.
+s32
+flushBuffer(Arena* buffer, s32 fd)
+{
+    s32 nsend = 0;
+    if (buffer->pos)
+        nsend = send(fd, buffer->addr, buffer->pos, 0);
+    if (nsend != (s32)buffer->pos) nsend = -1;
+    ArenaReset(buffer);
+    return nsend;
+}
+
+// Returns size bytes at the end of buffer, when it is full it is sent on fd first.  Returns 0 if
+// sending failed.
+void*
+pushBuffer(Arena* buffer, s32 fd, u32 size)
+{
+    assert(size <= buffer->size);
+    if (buffer->pos + size > buffer->size && flushBuffer(buffer, fd) == -1)
+        return 0;
+    return ArenaPush(buffer, size);
+}
+
+// Add notification header and message for client to batch in buffer.  A new batch is started
+// when there is none or it is full, then buffer is sent first if the batch might not fit.  See
+// "Batches" in protocol.h.
+// Returns 0 if sending failed.
+u32
+batchNotification(Arena* buffer, Batch* batch, Client* client, HeaderMessage* header, void* message)
+{
+    u32 entry = batchEntryMax(header, message);
+    if (!batch->at || batch->message.size + entry > BATCH_SIZE)
+    {
+        u32 size = sizeof(HeaderMessage) + sizeof(BatchMessage) + BATCH_SIZE;
+        if (buffer->pos + size > buffer->size && flushBuffer(buffer, client->conn->fd) == -1)
+            return 0;
+        batchBegin(batch, buffer, client->sent);
+    }
+    batchPush(batch, buffer, header, message);
+    if (header->seq > client->sent)
+        client->sent = header->seq;
+    return 1;
+}
+
+// Send notifications in ring after seq to client's connection except for the ones it sent
+// itself and the ones in rooms it is not a member of.  They are batched in buffer.
+// Returns 0 if the ring does not contain all notifications after seq anymore.
+u32
+replayMessages(MessageRing* ring, Room* rooms, Arena* buffer, Client* client, u64 seq)
+{
+    if (seq > ring->seq || ring->seq - seq > RING_SIZE) return 0;
+    
+    client->sent = seq;
+    ArenaReset(buffer);
+    Batch batch = {0};
+    u32 nreplayed = 0;
+    for (u64 at = seq + 1; at <= ring->seq; at++)
+    {
+        RingEntry* entry = ring->entries + (at % RING_SIZE);
+        assert(entry->header.seq == at);
+        if (entry->header.id == client->id) continue;
+        // Only members get the messages of a room
+        if (entry->header.type == HEADER_TYPE_TEXT && entry->buffer->text.room)
         {
-            if (clients[i].bifd && clients[i].bifd->fd != -1)
-                fd = clients[i].bifd->fd;
-            else
-                continue;
+            Room* room = getRoom(rooms, entry->buffer->text.room, 0);
+            if (!room || findRoomMember(room, client) == -1) continue;
         }
-        nsend = sendAnyMessage(fd, *header, anyMessage);
         
-        assert(nsend != -1);
-        LoggingF("sendToOthers "CLIENT_FMT"|%d<-%s %d bytes\n", CLIENT_ARG((clients[i])), fd, headerTypeString(header->type), nsend);
+        void* message = (entry->header.type == HEADER_TYPE_TEXT) ? (void*)&entry->buffer->text : (void*)&entry->presence;
+        if (!batchNotification(buffer, &batch, client, &entry->header, message)) break;
+        nreplayed++;
     }
+    flushBuffer(buffer, client->conn->fd);
+    LoggingF("Replayed %u message(s) to "CLIENT_FMT"\n", nreplayed, CLIENT_ARG((*client)));
+    return 1;
 }
 
-// Send header and anyMessage to each connection in fds that is nfds number of connections.
-// Does not send if pollfd is not set or pollfd->fd is -1.
-// Type will filter out only connections matching the type.
+// Record the presence changes in queue once PRESENCE_WINDOW passed since the first one and send
+// them to each client in online in a batch, leaving out its own change.
+// Returns time in milliseconds until the changes are due or -1 if there are none.
+s32
+flushPresence(PresenceQueue* queue, MessageRing* ring, OnlineClients* online, Arena* buffer)
+{
+    PendingPresence* entries = queue->entries.addr;
+    u32 count = queue->entries.pos / sizeof(*entries);
+    if (!count) return -1;
+    
+    u64 now = getTimeMs();
+    if (queue->start + PRESENCE_WINDOW > now)
+        return queue->start + PRESENCE_WINDOW - now;
+    
+    for (u32 i = 0; i < count; i++)
+    {
+        recordMessage(ring, &entries[i].header, &entries[i].message);
+        entries[i].client->info->presence = 0;
+        // Others forget that a client that connects or disconnects was away
+        u8 type = entries[i].message.type;
+        if (type == PRESENCE_TYPE_CONNECTED || type == PRESENCE_TYPE_DISCONNECTED)
+            entries[i].client->info->away = 0;
+    }
+    
+    for (u32 i = 0; i < online->count; i++)
+    {
+        Client* other = online->clients[i];
+        if (other->conn->fd == -1) continue;
+        
+        ArenaReset(buffer);
+        Batch batch = {0};
+        for (u32 j = 0; j < count; j++)
+        {
+            if (entries[j].client == other) continue;
+            if (!batchNotification(buffer, &batch, other, &entries[j].header, &entries[j].message))
+                break;
+        }
+        flushBuffer(buffer, other->conn->fd);
+    }
+    LoggingF("Sent %u presence change(s) to %u client(s)\n", count, online->count);
+    
+    ArenaReset(&queue->entries);
+    return -1;
+}
+
+// Send client the ids and authors of the clients in online in RosterMessages of at most
+// ROSTER_MAX clients, gathered in buffer.  See "Roster" in protocol.h.
 void
-sendToAll(Client* clients, u32 nclients, ClientFD type, HeaderMessage* header, void* anyMessage)
+sendRoster(OnlineClients* online, Arena* buffer, Client* client)
 {
-    s32 nsend;
-    for (u32 i = 0; i < nclients - 1; i++)
-	{
-        if (type == UNIFD)
+    s32 fd = client->conn->fd;
+    ArenaReset(buffer);
+    
+    HeaderMessage header = HEADER_INIT(HEADER_TYPE_ROSTER);
+    u32 size = sizeof(header) + sizeof(RosterMessage);
+    RosterMessage* message = 0;
+    for (u32 i = 0; i < online->count; i++)
+    {
+        Client* other = online->clients[i];
+        if (other == client) continue;
+        
+        if (!message || message->len == ROSTER_MAX)
         {
-            if (clients[i].unifd && clients[i].unifd->fd != -1)
-                nsend = sendAnyMessage(clients[i].unifd->fd, *header, anyMessage);
-            else
-                continue;
+            u8* addr = pushBuffer(buffer, fd, size);
+            if (!addr) return;
+            memcpy(addr, &header, sizeof(header));
+            message = (RosterMessage*)(addr + sizeof(header));
+            memset(message, 0, sizeof(*message));
         }
-        else if (type == BIFD)
+        RosterEntry* entry = message->entries + message->len++;
+        entry->id = other->id;
+        memcpy(entry->author, other->info->author, AUTHOR_LEN);
+    }
+    if (flushBuffer(buffer, fd) == -1) return;
+    LoggingF("Sent roster of %u client(s) to "CLIENT_FMT"\n", online->count - 1, CLIENT_ARG((*client)));
+}
+
+// Give the entries in client's inbox before until back to inboxPool, all of them if until is
+// 0.
+void
+freeInbox(Pool* inboxPool, Client* client, InboxEntry* until)
+{
+    ClientInfo* info = client->info;
+    while (info->inbox != until)
+    {
+        InboxEntry* entry = info->inbox;
+        info->inbox = entry->next;
+        releaseBuffer(entry->buffer);
+        PoolFree(inboxPool, entry);
+        info->ninbox--;
+    }
+    if (!info->inbox)
+        info->inboxLast = 0;
+}
+
+// Send client the text messages it missed since it went offline, up to the last INBOX_MAX in
+// room 0 and rooms it is a member of, followed by the direct messages in its inbox.  They are
+// batched in buffer so they are usually sent in a single write, texts are read from the
+// messages file into scratch.  What was written is taken off client's inbox, its entries go
+// back to inboxPool.
+void
+sendInbox(MessageRing* ring, Room* rooms, Arena* buffer, Arena* scratch, Pool* inboxPool,
+          Client* client)
+{
+    s32 fd = client->conn->fd;
+    u64 missed[INBOX_MAX];
+    u32 nmissed = 0;
+    
+    // Newest first, so only the last INBOX_MAX are kept
+    RoomID checked = 0;
+    u32 member = 0;
+    for (u64 seq = ring->seq; seq > client->info->offline && nmissed < INBOX_MAX; seq--)
+    {
+        // Older ones are gone too
+        LogEntry* entry = getLogEntry(ring, seq);
+        if (!entry) break;
+        
+        if (!entry->size || entry->id == client->id) continue;
+        if (entry->room && entry->room != checked)
         {
-            if (clients[i].bifd && clients[i].bifd->fd != -1)
-                nsend = sendAnyMessage(clients[i].bifd->fd, *header, anyMessage);
-            else
-                continue;
+            Room* room = getRoom(rooms, entry->room, 0);
+            member = (room && findRoomMember(room, client) != -1);
+            checked = entry->room;
         }
-        else
-            assert(0);
-        assert(nsend != -1);
-        LoggingF("sendToAll|[%s]->"CLIENT_FMT" %d bytes\n", headerTypeString(header->type),
-                 CLIENT_ARG(clients[i]),
-                 nsend);
+        if (entry->room && !member) continue;
+        
+        missed[nmissed++] = seq;
+    }
+    
+    // When the connection fails the rest is kept for the next authentication.  buffer is
+    // written when it is full, which is noticed by it getting shorter, so what went out before
+    // is not sent again.
+    ArenaReset(buffer);
+    Batch batch = {0};
+    for (u32 i = nmissed; i > 0; i--)
+    {
+        LogEntry* entry = getLogEntry(ring, missed[i - 1]);
+        ArenaTemp temp = ArenaTempBegin(scratch);
+        HeaderMessage* header = ArenaPushAligned(scratch, entry->size, _Alignof(HeaderMessage));
+        s32 nread = pread(ring->logfd, header, entry->size, entry->offset % LOG_BYTES);
+        assert(nread == (s32)entry->size);
+        u64 pos = buffer->pos;
+        u32 sent = batchNotification(buffer, &batch, client, header, header + 1);
+        ArenaTempEnd(temp);
+        if (!sent) return;
+        if (buffer->pos < pos && i < nmissed)
+            client->info->offline = missed[i];
+    }
+    u32 ninbox = 0;
+    for (InboxEntry* entry = client->info->inbox; entry; entry = entry->next)
+    {
+        u64 pos = buffer->pos;
+        if (!batchNotification(buffer, &batch, client, &entry->header, &entry->buffer->text))
+            return;
+        if (buffer->pos < pos)
+        {
+            client->info->offline = ring->seq;
+            freeInbox(inboxPool, client, entry);
+        }
+        ninbox++;
     }
+    if (flushBuffer(buffer, fd) == -1) return;
+    
+    if (nmissed || ninbox)
+        LoggingF("Sent %u missed and %u direct message(s) to "CLIENT_FMT"\n", nmissed, ninbox, CLIENT_ARG((*client)));
+    client->info->offline = ring->seq;
+    freeInbox(inboxPool, client, 0);
 }
 
-// Disconnect a client by closing the matching file descriptors
+// Close connection, when it is the connection of a client the client is detached.
 void
-disconnect(Client* client)
+dropConnection(DetachedQueue* queue, PresenceQueue* presence, OnlineClients* online, Connection* connection)
 {
-    LoggingF("Disconnecting "CLIENT_FMT"\n", CLIENT_ARG((*client)));
-    if (client->unifd && client->unifd->fd != -1)
+    Client* client = connection->client;
+    if (client && client->conn == connection)
+        detach(queue, presence, online, client);
+    else
+        closeConnection(connection);
+}
+
+// Notify others about clients in queue that did not resume their session in time.
+// Returns time in milliseconds until the next client expires or -1 if there are none.
+s32
+expireDetached(DetachedQueue* queue, PresenceQueue* presence, Client* clients, u32 nclients)
+{
+    u64 now = getTimeMs();
+    while (queue->len)
+    {
+        Detached* entry = queue->entries + queue->head;
+        if (entry->time + SESSION_GRACE > now)
+            return entry->time + SESSION_GRACE - now;
+        
+        queue->head = (queue->head + 1) % MAX_CONNECTIONS;
+        queue->len--;
+        
+        // Skip clients that resumed or lost their connection again since
+        Client* client = getClientByID(clients, nclients, entry->id);
+        if (!client || client->info->detached != entry->time) continue;
+        
+        LoggingF("Session expired "CLIENT_FMT"\n", CLIENT_ARG((*client)));
+        client->info->detached = 0;
+        queuePresence(presence, client, PRESENCE_TYPE_DISCONNECTED);
+    }
+    return -1;
+}
+
+// Report clients whose timer in afkTimers expired at tick as away.
+void
+expireAfk(TimerWheel* afkTimers, PresenceQueue* presence, Registry* registry, u64 tick)
+{
+    Client* clients = registry->clients.addr;
+    ClientInfo* infos = registry->infos.addr;
+    for (Timer* timer = TimerAdvance(afkTimers, tick); timer; timer = timer->next)
+    {
+        ClientInfo* info = (ClientInfo*)((u8*)timer - offsetof(ClientInfo, afk));
+        Client* client = clients + (info - infos);
+        if (!client->conn || info->away) continue;
+        
+        LoggingF("Away "CLIENT_FMT"\n", CLIENT_ARG((*client)));
+        info->away = 1;
+        queuePresence(presence, client, PRESENCE_TYPE_AFK);
+    }
+}
+
+// Handle connections whose timer in heartbeats expired at tick, nothing was received on them
+// for HEARTBEAT_INTERVAL.  Authenticated ones are pinged until HEARTBEAT_MISSED pings went
+// unanswered, then they are dropped like the others.  See "Heartbeats" in protocol.h.
+void
+expireHeartbeats(TimerWheel* heartbeats, DetachedQueue* queue, PresenceQueue* presence,
+                 OnlineClients* online, u64 tick)
+{
+    Timer* timer = TimerAdvance(heartbeats, tick);
+    while (timer)
     {
-        close(client->unifd->fd);
-        client->unifd->fd = -1;
-        client->unifd = 0;
+        // Closing removes the timer
+        Timer* next = timer->next;
+        Connection* connection = (Connection*)((u8*)timer - offsetof(Connection, heartbeat));
+        timer = next;
+        
+        if (!connection->client)
+        {
+            LoggingF("No authentication on connection(%d)\n", connection->fd);
+            dropConnection(queue, presence, online, connection);
+            continue;
+        }
+        if (connection->missed == HEARTBEAT_MISSED)
+        {
+            LoggingF("Missed %u heartbeats "CLIENT_FMT"\n", connection->missed,
+                     CLIENT_ARG((*connection->client)));
+            dropConnection(queue, presence, online, connection);
+            continue;
+        }
+        
+        HeaderMessage header = HEADER_INIT(HEADER_TYPE_PING);
+        PingMessage message = {.timestamp = getTimeMs()};
+        if (sendAnyMessage(connection->fd, header, &message) == -1)
+        {
+            dropConnection(queue, presence, online, connection);
+            continue;
+        }
+        connection->missed++;
+        TimerAdd(heartbeats, &connection->heartbeat, tick + HEARTBEAT_INTERVAL / TIMER_TICK);
     }
-    if (client->bifd && client->bifd->fd != -1)
+}
+
+// Send header and anyMessage to each connected member of room except for client.
+void
+sendToRoom(Room* room, Client* client, HeaderMessage* header, void* anyMessage)
+{
+    for (u32 i = 0; i < room->count; i++)
+    {
+        Client* member = room->members[i];
+        if (member == client) continue;
+        if (!member->conn || member->conn->fd == -1) continue;
+        
+        s32 nsend = sendNotification(member, *header, anyMessage);
+        LoggingF("sendToRoom %u "CLIENT_FMT"|%s %d bytes\n", room->id, CLIENT_ARG((*member)),
+                 headerTypeString(header->type), nsend);
+    }
+}
+
+// Bind connection to client, closing its previous connection if it is still open, and add
+// client to online.
+// Returns 1 if other clients still see client as connected.
+u32
+bindConnection(OnlineClients* online, Client* client, Connection* connection)
+{
+    u32 connected = (client->conn != 0 || client->info->detached != 0);
+    
+    // The client reconnected before its old connection was noticed to be closed.  Like when
+    // detaching, what it did not acknowledge on the old connection counts as missed.
+    if (client->conn && client->conn != connection && client->conn->fd != -1)
     {
-        close(client->bifd->fd);
-        client->bifd->fd = -1;
-        client->bifd = 0;
+        LoggingF("bindConnection (%d)|replacing connection (%d)\n", connection->fd, client->conn->fd);
+        closeConnection(client->conn);
+        client->info->offline = client->info->acked;
     }
+    client->conn = connection;
+    connection->client = client;
+    client->info->detached = 0;
+    setOnline(online, client);
+    
+    return connected;
 }
 
-// Disconnects fds+conn from fds with nfds connections, then send a PresenceMessage to other
-// clients about disconnection.
+// Create a new session token for client and send it with the current sequence number.
 void
-disconnectAndNotify(Client* clients, u32 nclients, Client* client)
+sendSession(Client* client, MessageRing* ring, u32 request)
 {
-    disconnect(client);
+    s32 err = getrandom(&client->info->token, sizeof(client->info->token), 0);
+    assert(err == sizeof(client->info->token));
     
-    local_persist HeaderMessage header = HEADER_INIT(HEADER_TYPE_PRESENCE);
+    HeaderMessage header = HEADER_INIT(HEADER_TYPE_SESSION);
+    header.request = request;
     header.id = client->id;
-    PresenceMessage message = {.type = PRESENCE_TYPE_DISCONNECTED};
-    sendToAll(clients, nclients, UNIFD, &header, &message);
+    SessionMessage message = {.token = client->info->token, .seq = ring->seq};
+    // A failed send is noticed when the connection is polled next
+    sendAnyMessage(client->conn->fd, header, &message);
+    client->sent = ring->seq;
+    client->info->acked = ring->seq;
 }
 
-// Receive authentication from pollfd->fd and create client out of it.  Look in
-// clientsArena if it already exists.  Otherwise push a new onto the arena and write its information
-// to clients_file.
+// Receive authentication from connection->fd and create client out of it.  Look in
+// registry if it already exists.  Otherwise add a new one and write its author to
+// clients_file.
 // See "Authentication" in chatty.h
-// Assumes that the client will send a IDMessage or IntroductionMessage
+// Assumes that the client will send a IDMessage, IntroductionMessage or ResumeMessage
+// If other clients still see the client as connected replaced is set to 1.
 // Returns authenticated client
 Client*
-authenticate(Arena* clientsArena, s32 clients_file, struct pollfd* pollfd, HeaderMessage header)
+authenticate(Registry* registry, s32 clients_file, MessageRing* ring, Room* rooms,
+             OnlineClients* online, Arena* buffer, Connection* connection, HeaderMessage header,
+             u32* replaced)
 {
     s32 nrecv = 0;
     Client* client = 0;
     
-    LoggingF("authenticate (%d)|" HEADER_FMT "\n", pollfd->fd, HEADER_ARG(header));
+    LoggingF("authenticate (%d)|" HEADER_FMT "\n", connection->fd, HEADER_ARG(header));
     
     /* Scenario 1: Search for existing client */
     if (header.type == HEADER_TYPE_ID)
     {
         IDMessage message;
-        s32 nrecv = recv(pollfd->fd, &message, sizeof(message), 0);
+        s32 nrecv = recv(connection->fd, &message, sizeof(message), 0);
         assert(nrecv == sizeof(message));
         
-        client = getClientByID((Client*)clientsArena->addr, nclients, message.id);
+        client = getClientByID((Client*)registry->clients.addr, nclients, message.id);
         if (!client)
         {
-            LoggingF("authenticate (%d)|notfound\n", pollfd->fd);
-            header.type = HEADER_TYPE_ERROR;
-            ErrorMessage error_message = ERROR_INIT(ERROR_TYPE_NOTFOUND);
-            sendAnyMessage(pollfd->fd, header, &error_message);
+            LoggingF("authenticate (%d)|notfound\n", connection->fd);
+            sendError(connection->fd, header.request, 0, ERROR_TYPE_NOTFOUND, 0);
             return 0;
         }
         else
         {
-            LoggingF("authenticate (%d)|found [%s](%lu)\n", pollfd->fd, client->author, client->id);
-            header.type = HEADER_TYPE_ERROR;
-            ErrorMessage error_message = ERROR_INIT(ERROR_TYPE_SUCCESS);
-            sendAnyMessage(pollfd->fd, header, &error_message);
+            LoggingF("authenticate (%d)|found [%s](%lu)\n", connection->fd, client->info->author, client->id);
+            sendError(connection->fd, header.request, 0, ERROR_TYPE_SUCCESS, 0);
         }
         
-        if (!client->bifd)
-            client->bifd = pollfd;
-        else if (!client->unifd)
-            client->unifd = pollfd;
-        else
-            assert(0);
+        *replaced = bindConnection(online, client, connection);
+        sendSession(client, ring, header.request);
+        
+        return client;
+    }
+    /* Scenario 3: Resume a session */
+    else if (header.type == HEADER_TYPE_RESUME)
+    {
+        ResumeMessage message;
+        nrecv = recv(connection->fd, &message, sizeof(message), 0);
+        if (nrecv != sizeof(message))
+        {
+            LoggingF("authenticate (%d)|err: %d/%lu bytes\n", connection->fd, nrecv, sizeof(message));
+            return 0;
+        }
+        
+        client = getClientByID((Client*)registry->clients.addr, nclients, message.id);
+        if (!client || !client->info->token || client->info->token != message.token)
+        {
+            LoggingF("authenticate (%d)|session notfound\n", connection->fd);
+            sendError(connection->fd, header.request, 0, ERROR_TYPE_NOTFOUND, 0);
+            return 0;
+        }
+        if (message.seq > ring->seq || ring->seq - message.seq > RING_SIZE)
+        {
+            LoggingF("authenticate (%d)|session expired "CLIENT_FMT"\n", connection->fd, CLIENT_ARG((*client)));
+            sendError(connection->fd, header.request, 0, ERROR_TYPE_EXPIRED, 0);
+            return 0;
+        }
         
+        LoggingF("authenticate (%d)|resumed "CLIENT_FMT" from %lu\n", connection->fd, CLIENT_ARG((*client)), message.seq);
+        sendError(connection->fd, header.request, 0, ERROR_TYPE_SUCCESS, 0);
+        
+        *replaced = bindConnection(online, client, connection);
+        // Like acknowledgements it only moves forward, so older notifications do not count as
+        // missed again when the client authenticates later
+        if (message.seq > client->info->acked && message.seq <= ring->seq)
+            client->info->acked = message.seq;
+        replayMessages(ring, rooms, buffer, client, message.seq);
+        // Only direct messages are left for sendInbox()
+        client->info->offline = ring->seq;
         
         return client;
     }
@@ -273,72 +1519,575 @@ authenticate(Arena* clientsArena, s32 clients_file, struct pollfd* pollfd, Heade
     else if (header.type == HEADER_TYPE_INTRODUCTION)
     {
         IntroductionMessage message;
-        nrecv = recv(pollfd->fd, &message, sizeof(message), 0);
+        nrecv = recv(connection->fd, &message, sizeof(message), 0);
         if (nrecv != sizeof(message))
         {
-            LoggingF("authenticate (%d)|err: %d/%lu bytes\n", pollfd->fd, nrecv, sizeof(message));
+            LoggingF("authenticate (%d)|err: %d/%lu bytes\n", connection->fd, nrecv, sizeof(message));
             return 0;
         }
         
         // Copy metadata from IntroductionMessage
-        client = ArenaPush(clientsArena, sizeof(*client));
-        memcpy(client->author, message.author, AUTHOR_LEN);
-        client->id = nclients;
-        
-        if (!client->bifd)
-            client->bifd = pollfd; 
-        else if (!client->unifd)
-            client->unifd = pollfd;
-        else
-            assert(0);
-        
-        nclients++;
+        client = addClient(registry, message.author);
+        client->conn = connection;
+        connection->client = client;
+        client->info->offline = ring->seq;
+        setOnline(online, client);
+        *replaced = 0;
         
 #ifdef IMPORT_ID
-        write(clients_file, client, sizeof(*client));
+        write(clients_file, client->info->author, AUTHOR_LEN);
 #endif
-        LoggingF("authenticate (%d)|Added [%s](%lu)\n", pollfd->fd, client->author, client->id);
+        LoggingF("authenticate (%d)|Added [%s](%lu)\n", connection->fd, client->info->author, client->id);
         
         // Send ID to new client
+        u32 request = header.request;
         HeaderMessage header = HEADER_INIT(HEADER_TYPE_ID);
+        header.request = request;
         IDMessage id_message;
         id_message.id = client->id;
         
-        s32 nsend = sendAnyMessage(pollfd->fd, header, &id_message);
-        assert(nsend != -1);
+        sendAnyMessage(connection->fd, header, &id_message);
+        sendSession(client, ring, request);
         
         return client;
     }
     
-    LoggingF("authenticate (%d)|Wrong header expected %s or %s\n", pollfd->fd,
+    LoggingF("authenticate (%d)|Wrong header expected %s, %s or %s\n", connection->fd,
              headerTypeString(HEADER_TYPE_INTRODUCTION),
-             headerTypeString(HEADER_TYPE_ID));
+             headerTypeString(HEADER_TYPE_ID),
+             headerTypeString(HEADER_TYPE_RESUME));
+    return 0;
+}
+
+// Start shutting down, see drainServer().
+void
+requestStop(int signo)
+{
+    stopRequested = 1;
+}
+
+// Read the text of notification seq back from ring's messages file into a buffer from buffers.
+// Returns the buffer with one reference or 0 if the text is not kept anymore or there was no
+// buffer left.
+MessageBuffer*
+loadBuffer(BufferPools* buffers, MessageRing* ring, u64 seq)
+{
+    LogEntry* entry = getLogEntry(ring, seq);
+    if (!entry) return 0;
+    u32 size = entry->size - sizeof(HeaderMessage);
+    MessageBuffer* buffer = allocBuffer(buffers, size - TEXTMESSAGE_SIZE);
+    if (!buffer) return 0;
+    s32 nread = pread(ring->logfd, &buffer->text, size, entry->offset % LOG_BYTES + sizeof(HeaderMessage));
+    assert(nread == (s32)size);
+    return buffer;
+}
+
+// Send size bytes of data on the unix socket fd, the nfds file descriptors in passed go along
+// with the first byte.
+// Returns -1 if sending failed.
+s32
+sendHandoff(s32 fd, void* data, u64 size, s32* passed, u32 nfds)
+{
+    union {
+        struct cmsghdr header;
+        u8 buf[CMSG_SPACE(HANDOFF_FDS * sizeof(s32))];
+    } control;
+    struct iovec iov = {data, size};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (nfds)
+    {
+        assert(nfds <= HANDOFF_FDS);
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(s32));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(s32));
+        memcpy(CMSG_DATA(cmsg), passed, nfds * sizeof(s32));
+    }
+    
+    while (iov.iov_len)
+    {
+        s64 nsend = sendmsg(fd, &msg, 0);
+        if (nsend == -1) return -1;
+        iov.iov_base = (u8*)iov.iov_base + nsend;
+        iov.iov_len -= nsend;
+        msg.msg_control = 0;
+        msg.msg_controllen = 0;
+    }
     return 0;
 }
 
+// Receive size bytes into data from the unix socket fd and the nfds file descriptors sent along
+// into passed.
+// Returns -1 if receiving failed or a different number of file descriptors was sent, the ones
+// received are closed then.
+s32
+recvHandoff(s32 fd, void* data, u64 size, s32* passed, u32 nfds)
+{
+    union {
+        struct cmsghdr header;
+        u8 buf[CMSG_SPACE(HANDOFF_FDS * sizeof(s32))];
+    } control;
+    struct iovec iov = {data, size};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    
+    u32 npassed = 0;
+    while (iov.iov_len)
+    {
+        s64 nrecv = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+        if (nrecv <= 0 || (msg.msg_flags & MSG_CTRUNC)) break;
+        
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            u32 count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(s32);
+            s32* received = (s32*)CMSG_DATA(cmsg);
+            for (u32 i = 0; i < count; i++)
+            {
+                if (npassed < nfds)
+                    passed[npassed] = received[i];
+                else
+                    close(received[i]);
+                npassed++;
+            }
+        }
+        
+        iov.iov_base = (u8*)iov.iov_base + nrecv;
+        iov.iov_len -= nrecv;
+        msg.msg_control = 0;
+        msg.msg_controllen = 0;
+    }
+    if (!iov.iov_len && npassed == nfds) return 0;
+    
+    for (u32 i = 0; i < npassed && i < nfds; i++)
+        close(passed[i]);
+    return -1;
+}
+
+// Listen on RESTART_SOCKET for a new server taking over, see handOff().
+// Returns the listening socket or -1.
+s32
+listenRestart(void)
+{
+    s32 fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    memcpy(address.sun_path, RESTART_SOCKET, sizeof(RESTART_SOCKET));
+    unlink(RESTART_SOCKET);
+    // Only the same user can take over
+    mode_t mask = umask(0077);
+    s32 err = bind(fd, (struct sockaddr*)&address, sizeof(address));
+    umask(mask);
+    if (err || listen(fd, 1))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Hand this server over to a new one connecting on restartfd.  The listening socket serverfd,
+// the messages file and the nfds - FDS_CLIENTS connections are passed to it with the sessions,
+// rooms and direct messages, so clients keep their connection.  The new server must have
+// imported the same CLIENTS_FILE, pending presence changes have to be sent before.
+// Returns 1 if the new server took over, this one must then exit without touching the
+// connections.  Returns 0 if the handoff failed and this server continues.
+u32
+handOff(s32 restartfd, s32 serverfd, Registry* registry, MessageRing* ring,
+        DetachedQueue* detachedQueue, Room* rooms, Connections* connections, u32 nfds)
+{
+    s32 fd = accept4(restartfd, 0, 0, SOCK_CLOEXEC);
+    if (fd == -1) return 0;
+    LoggingF("Handing off to a new server (%d)\n", fd);
+    
+    Client* clients = registry->clients.addr;
+    ClientInfo* infos = registry->infos.addr;
+    HandoffState state = {.nclients = nclients, .seq = ring->seq, .logSize = ring->logSize};
+    Arena out;
+    ArenaAlloc(&out, Gigabytes(2));
+    
+    u32 nlog = (ring->seq < LOG_SIZE) ? ring->seq + 1 : LOG_SIZE;
+    memcpy(PushArray(&out, LogEntry, nlog), ring->log, nlog * sizeof(LogEntry));
+    memcpy(PushArray(&out, RingEntry, RING_SIZE), ring->entries, sizeof(ring->entries));
+    
+    for (u32 i = 0; i < nclients - 1; i++)
+    {
+        HandoffClient* session = PushStruct(&out, HandoffClient);
+        session->token = infos[i].token;
+        session->detached = infos[i].detached;
+        session->offline = infos[i].offline;
+        session->acked = infos[i].acked;
+        session->sent = clients[i].sent;
+        session->away = infos[i].away;
+    }
+    
+    for (; state.ndetached < detachedQueue->len; state.ndetached++)
+    {
+        u32 index = (detachedQueue->head + state.ndetached) % MAX_CONNECTIONS;
+        *PushStruct(&out, Detached) = detachedQueue->entries[index];
+    }
+    
+    for (u32 i = 0; i < ROOMS_MAX; i++)
+    {
+        Room* room = rooms + i;
+        if (!room->id) continue;
+        
+        *PushStruct(&out, HandoffRoom) = (HandoffRoom){room->id, room->count};
+        ID* members = PushArray(&out, ID, room->count);
+        for (u32 j = 0; j < room->count; j++)
+            members[j] = room->members[j]->id;
+        state.nrooms++;
+    }
+    
+    for (u32 i = 0; i < nclients - 1; i++)
+    {
+        for (InboxEntry* entry = infos[i].inbox; entry; entry = entry->next)
+        {
+            *PushStruct(&out, HandoffInbox) = (HandoffInbox){clients[i].id, entry->header};
+            TextMessage* text = &entry->buffer->text;
+            u32 size = TEXTMESSAGE_SIZE + text->len * sizeof(*text->text);
+            memcpy(ArenaPush(&out, size), text, size);
+            state.ninbox++;
+        }
+    }
+    
+    for (u32 conn = FDS_CLIENTS; conn < nfds; conn++)
+        state.nconnections += (connections->polled[conn]->fd != -1);
+    state.size = out.pos;
+    
+    s32 passed[HANDOFF_FDS] = {serverfd, ring->logfd};
+    s32 err = sendHandoff(fd, &state, sizeof(state), passed, 2);
+    if (!err)
+        err = sendHandoff(fd, out.addr, out.pos, 0, 0);
+    ArenaRelease(&out);
+    
+    HandoffConnections message = {0};
+    for (u32 conn = FDS_CLIENTS; !err && conn < nfds; conn++)
+    {
+        Connection* connection = connections->polled[conn];
+        if (connection->fd == -1) continue;
+        
+        passed[message.count] = connection->fd;
+        message.ids[message.count] = connection->client ? connection->client->id : 0;
+        message.count++;
+        if (message.count == HANDOFF_FDS)
+        {
+            err = sendHandoff(fd, &message, sizeof(message), passed, message.count);
+            message.count = 0;
+        }
+    }
+    if (!err && message.count)
+        err = sendHandoff(fd, &message, sizeof(message), passed, message.count);
+    
+    // The new server confirms once it has everything
+    u8 ack = 0;
+    if (!err && recv(fd, &ack, sizeof(ack), MSG_WAITALL) != sizeof(ack))
+        err = -1;
+    close(fd);
+    
+    if (err)
+    {
+        LoggingF("Handoff failed, errno: %d\n", errno);
+        return 0;
+    }
+    LoggingF("Handed off %u connection(s) at seq %lu\n", state.nconnections, state.seq);
+    return 1;
+}
+
+// Close the listening socket, log file and connections takeOver() received so far.  The old server
+// keeps its own copies of them.
+void
+closeHandoff(Connections* connections, s32 serverfd, s32 logfd)
+{
+    close(serverfd);
+    close(logfd);
+    for (u32 conn = FDS_CLIENTS; conn < FDS_CLIENTS + connections->count; conn++)
+        closeConnection(connections->polled[conn]);
+}
+
+// Take over from the server listening on RESTART_SOCKET, see handOff().  Its connections are
+// added to connections and fdsArena, the rest of its state is loaded into the other arguments
+// which must not hold anything but the clients imported from CLIENTS_FILE.
+// Returns the listening socket or -1 if taking over failed, the old server then continues.
+s32
+takeOver(Registry* registry, MessageRing* ring, DetachedQueue* detachedQueue, Room* rooms,
+         Connections* connections, Arena* fdsArena, OnlineClients* online, Pool* inboxPool,
+         BufferPools* buffers, TimerWheel* heartbeats, TimerWheel* afkTimers)
+{
+    s32 fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    assert(fd != -1);
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    memcpy(address.sun_path, RESTART_SOCKET, sizeof(RESTART_SOCKET));
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)))
+    {
+        LoggingF("No server to take over from, errno: %d\n", errno);
+        close(fd);
+        return -1;
+    }
+    
+    HandoffState state;
+    s32 passed[HANDOFF_FDS];
+    if (recvHandoff(fd, &state, sizeof(state), passed, 2))
+    {
+        LoggingF("Handoff failed, errno: %d\n", errno);
+        close(fd);
+        return -1;
+    }
+    s32 serverfd = passed[0];
+    if (state.nclients != nclients)
+    {
+        LoggingF("Handoff failed, the old server has %u client(s) instead of %u\n",
+                 state.nclients - 1, nclients - 1);
+        closeHandoff(connections, serverfd, passed[1]);
+        close(fd);
+        return -1;
+    }
+    
+    Arena in;
+    ArenaAlloc(&in, state.size);
+    if (recvHandoff(fd, ArenaPush(&in, state.size), state.size, 0, 0))
+    {
+        LoggingF("Handoff failed, errno: %d\n", errno);
+        closeHandoff(connections, serverfd, passed[1]);
+        close(fd);
+        return -1;
+    }
+    // Go over the state the way handOff() pushed it
+    Arena payload = in;
+    payload.pos = 0;
+    
+    Client* clients = registry->clients.addr;
+    ClientInfo* infos = registry->infos.addr;
+    ring->seq = state.seq;
+    ring->logSize = state.logSize;
+    ring->logfd = passed[1];
+    u32 nlog = (state.seq < LOG_SIZE) ? state.seq + 1 : LOG_SIZE;
+    memcpy(ring->log, PushArray(&payload, LogEntry, nlog), nlog * sizeof(LogEntry));
+    
+    memcpy(ring->entries, PushArray(&payload, RingEntry, RING_SIZE), sizeof(ring->entries));
+    for (u32 i = 0; i < RING_SIZE; i++)
+    {
+        RingEntry* entry = ring->entries + i;
+        if (entry->header.seq && entry->header.type == HEADER_TYPE_TEXT)
+        {
+            // The ring is loaded first, the pools are as large as the old server's
+            entry->buffer = loadBuffer(buffers, ring, entry->header.seq);
+            assert(entry->buffer);
+        }
+    }
+    
+    HandoffClient* sessions = PushArray(&payload, HandoffClient, nclients - 1);
+    for (u32 i = 0; i < nclients - 1; i++)
+    {
+        infos[i].token = sessions[i].token;
+        infos[i].detached = sessions[i].detached;
+        infos[i].offline = sessions[i].offline;
+        infos[i].acked = sessions[i].acked;
+        infos[i].away = sessions[i].away;
+        clients[i].sent = sessions[i].sent;
+    }
+    
+    Detached* detached = PushArray(&payload, Detached, state.ndetached);
+    memcpy(detachedQueue->entries, detached, state.ndetached * sizeof(*detached));
+    detachedQueue->head = 0;
+    detachedQueue->len = state.ndetached;
+    
+    for (u32 i = 0; i < state.nrooms; i++)
+    {
+        HandoffRoom* handoff = PushStruct(&payload, HandoffRoom);
+        ID* members = PushArray(&payload, ID, handoff->count);
+        for (u32 j = 0; j < handoff->count; j++)
+            joinRoom(rooms, handoff->id, getClientByID(clients, nclients, members[j]));
+    }
+    
+    for (u32 i = 0; i < state.ninbox; i++)
+    {
+        HandoffInbox* handoff = PushStruct(&payload, HandoffInbox);
+        TextMessage* text = ArenaPush(&payload, TEXTMESSAGE_SIZE);
+        u32 text_size = text->len * sizeof(*text->text);
+        ArenaPush(&payload, text_size);
+        
+        MessageBuffer* buffer = allocBuffer(buffers, text_size);
+        if (!buffer)
+        {
+            LoggingF("No buffer for direct message to %lu, dropped\n", handoff->recipient);
+            continue;
+        }
+        memcpy(&buffer->text, text, TEXTMESSAGE_SIZE + text_size);
+        Client* recipient = getClientByID(clients, nclients, handoff->recipient);
+        if (!queueInbox(inboxPool, recipient, &handoff->header, buffer))
+            LoggingF("No inbox entry for direct message to %lu, dropped\n", handoff->recipient);
+        releaseBuffer(buffer);
+    }
+    assert(payload.pos == state.size);
+    ArenaRelease(&in);
+    
+    for (u32 received = 0; received < state.nconnections;)
+    {
+        HandoffConnections message;
+        u32 count = state.nconnections - received;
+        if (count > HANDOFF_FDS) count = HANDOFF_FDS;
+        s32 err = recvHandoff(fd, &message, sizeof(message), passed, count);
+        if (!err && message.count != count)
+        {
+            for (u32 i = 0; i < count; i++)
+                close(passed[i]);
+            err = -1;
+        }
+        if (err)
+        {
+            LoggingF("Handoff failed after %u connection(s), errno: %d\n", received, errno);
+            closeHandoff(connections, serverfd, ring->logfd);
+            close(fd);
+            return -1;
+        }
+        
+        for (u32 i = 0; i < count; i++)
+        {
+            Connection* connection = addConnection(connections, fdsArena, passed[i]);
+            TimerAdd(heartbeats, &connection->heartbeat, heartbeats->now + HEARTBEAT_INTERVAL / TIMER_TICK);
+            
+            Client* client = getClientByID(clients, nclients, message.ids[i]);
+            if (!client) continue;
+            client->conn = connection;
+            connection->client = client;
+            setOnline(online, client);
+            if (!client->info->away)
+                TimerAdd(afkTimers, &client->info->afk, afkTimers->now + AFK_TIMEOUT / TIMER_TICK);
+        }
+        received += count;
+    }
+    
+    u8 ack = 1;
+    s32 nsend = send(fd, &ack, sizeof(ack), 0);
+    close(fd);
+    if (nsend != sizeof(ack))
+    {
+        LoggingF("Handoff failed, errno: %d\n", errno);
+        closeHandoff(connections, serverfd, ring->logfd);
+        return -1;
+    }
+    
+    LoggingF("Took over %u connection(s) at seq %lu\n", state.nconnections, state.seq);
+    return serverfd;
+}
+
+// Shut down without losing what was sent: stop accepting connections, send the pending presence
+// changes and ask every client to come back later, see "Restarts" in protocol.h.  Then wait up
+// to DRAIN_TIMEOUT for clients to close their side, closing a connection with unread data
+// would reset it and throw away what is still queued for the client.  Sends do not block so a
+// client that stopped reading cannot hold up the others, it is dropped instead.
+void
+drainServer(struct pollfd* fds, u32 nfds, Connections* connections, PresenceQueue* presence,
+            MessageRing* ring, OnlineClients* online, Arena* buffer)
+{
+    close(fds[FDS_SERVER].fd);
+    close(fds[FDS_RESTART].fd);
+    unlink(RESTART_SOCKET);
+    fds[FDS_STDIN].fd = -1;
+    fds[FDS_SERVER].fd = -1;
+    fds[FDS_RESTART].fd = -1;
+    
+    // Not shared with a new server, see handOff()
+    for (u32 conn = FDS_CLIENTS; conn < nfds; conn++)
+    {
+        s32 fd = connections->polled[conn]->fd;
+        if (fd != -1)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    
+    // Due right away
+    presence->start = 0;
+    flushPresence(presence, ring, online, buffer);
+    
+    HeaderMessage header = HEADER_INIT(HEADER_TYPE_ERROR);
+    u32 open = 0;
+    for (u32 conn = FDS_CLIENTS; conn < nfds; conn++)
+    {
+        Connection* connection = connections->polled[conn];
+        fds[conn].fd = connection->fd;
+        if (connection->fd == -1) continue;
+        
+        if (connection->client)
+        {
+            u32 spread = (u64)RESTART_SPREAD * (conn - FDS_CLIENTS) / (nfds - FDS_CLIENTS);
+            ErrorMessage message = {.type = ERROR_TYPE_RESTARTING, .retry = RESTART_RETRY + spread};
+            // Its socket buffer is full, there is no telling when it reads again
+            if (sendAnyMessage(connection->fd, header, &message) == -1)
+            {
+                LoggingF("Dropped slow "CLIENT_FMT"\n", CLIENT_ARG((*connection->client)));
+                closeConnection(connection);
+                fds[conn].fd = -1;
+                continue;
+            }
+        }
+        shutdown(connection->fd, SHUT_WR);
+        open++;
+    }
+    LoggingF("Draining %u connection(s)\n", open);
+    
+    u64 deadline = getTimeMs() + DRAIN_TIMEOUT;
+    for (u64 now = getTimeMs(); open && now < deadline; now = getTimeMs())
+    {
+        s32 err = poll(fds, nfds, deadline - now);
+        if (err == -1 && errno != EINTR) break;
+        if (err <= 0) continue;
+        
+        for (u32 conn = FDS_CLIENTS; conn < nfds; conn++)
+        {
+            if (fds[conn].fd == -1 || !fds[conn].revents) continue;
+            
+            u8 discard[4096];
+            s32 nrecv = recv(fds[conn].fd, discard, sizeof(discard), MSG_DONTWAIT);
+            if (nrecv > 0 || (nrecv == -1 && errno == EAGAIN)) continue;
+            
+            closeConnection(connections->polled[conn]);
+            fds[conn].fd = -1;
+            open--;
+        }
+    }
+    
+    for (u32 conn = FDS_CLIENTS; conn < nfds; conn++)
+        closeConnection(connections->polled[conn]);
+    LoggingF("Closed %u connection(s) that were still open\n", open);
+}
+
 int
 main(int argc, char** argv)
 {
     signal(SIGPIPE, SIG_IGN);
+    // Interrupts poll() but not sends and receives
+    struct sigaction stop = {.sa_handler = requestStop, .sa_flags = SA_RESTART};
+    sigaction(SIGINT, &stop, 0);
+    sigaction(SIGTERM, &stop, 0);
     
     LogFD = 2;
-    // optional logging
-    if (argc > 1)
+    u32 restart = 0;
+    for (s32 i = 1; i < argc; i++)
     {
-        if (*argv[1] == '-')
-            if (argv[1][1] == 'l')
+        if (*argv[i] != '-') continue;
+        // optional logging
+        if (argv[i][1] == 'l')
         {
             LogFD = open(LOGFILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
             assert(LogFD != -1);
         }
+        // take over from the running server, see takeOver()
+        else if (argv[i][1] == 'r')
+            restart = 1;
     }
     
-    s32 serverfd;
-    // Start listening on the socket
+    s32 serverfd = -1;
+    // Start listening on the socket, when taking over the old server's socket is used instead
+    if (!restart)
     {
         s32 err;
         u32 on = 1;
-        serverfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        serverfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
         assert(serverfd > 2);
         
         err = setsockopt(serverfd, SOL_SOCKET, SO_REUSEADDR, (u8*)&on, sizeof(on));
@@ -359,27 +2108,66 @@ main(int argc, char** argv)
         LoggingF("Listening on :%d\n", PORT);
     }
     
-    Arena clientsArena;
+    Registry registry;
     Arena fdsArena;
-    Arena msgsArena;
-    ArenaAlloc(&clientsArena, MAX_CONNECTIONS * sizeof(Client));
-    ArenaAlloc(&fdsArena, MAX_CONNECTIONS * 2 * sizeof(struct pollfd));
-    ArenaAlloc(&msgsArena, Megabytes(128)); // storing received messages
+    Pool inboxPool;
+    Arena sendArena;
+    Arena scratchArena;
+    PresenceQueue presence = {0};
+    TimerWheel afkTimers;
+    TimerWheel heartbeats;
+    ArenaAlloc(&registry.clients, CLIENTS_MAX * sizeof(Client));
+    ArenaAlloc(&registry.infos, CLIENTS_MAX * sizeof(ClientInfo));
+    ArenaAlloc(&fdsArena, (FDS_CLIENTS + MAX_CONNECTIONS) * sizeof(struct pollfd));
+    PoolAllocType(&inboxPool, InboxEntry, 1 << 22); // direct messages for offline clients
+    ArenaAlloc(&sendArena, Megabytes(1)); // batching messages, see batchNotification()
+    ArenaAlloc(&scratchArena, Megabytes(1)); // temporary allocations
+    ArenaAlloc(&presence.entries, CLIENTS_MAX * sizeof(PendingPresence));
+    TimerWheelInit(&afkTimers, getTimeMs() / TIMER_TICK);
+    TimerWheelInit(&heartbeats, getTimeMs() / TIMER_TICK);
     struct pollfd* fds = fdsArena.addr;
-    Client* clients = clientsArena.addr;
+    Client* clients = registry.clients.addr;
+    
+    MessageRing* ring = mmap(0, sizeof(*ring), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(ring != MAP_FAILED);
+    ring->seq = 0;
+    ring->logSize = 0;
+    ring->logfd = -1;
+    if (!restart)
+    {
+        ring->logfd = open(MESSAGES_FILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        assert(ring->logfd != -1);
+    }
+    DetachedQueue* detachedQueue = mmap(0, sizeof(*detachedQueue), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(detachedQueue != MAP_FAILED);
+    Connections* connections = mmap(0, sizeof(*connections), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(connections != MAP_FAILED);
+    PoolAllocType(&connections->pool, Connection, MAX_CONNECTIONS);
+    Room* rooms = mmap(0, ROOMS_MAX * sizeof(*rooms), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(rooms != MAP_FAILED);
+    OnlineClients* online = mmap(0, sizeof(*online), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(online != MAP_FAILED);
+    AcceptBucket acceptBuckets[ACCEPT_BUCKETS] = {0};
+    BufferPools buffers;
+    PoolAlloc(&buffers.small, BUFFER_SMALL, 1 << 20);
+    PoolAlloc(&buffers.medium, BUFFER_MEDIUM, 1 << 18);
+    PoolAlloc(&buffers.large, BUFFER_LARGE, 1 << 14);
     
     // Initializing fds
     struct pollfd* fdsAddr;
     struct pollfd newpollfd = {-1, POLLIN, 0}; // for copying with events already set
     // initialize fds structure
     newpollfd.fd = 0;
-    fdsAddr = ArenaPush(&fdsArena, sizeof(*fds));
+    fdsAddr = PushStruct(&fdsArena, struct pollfd);
     memcpy(fdsAddr, &newpollfd, sizeof(*fds));
     // add serverfd
     newpollfd.fd = serverfd;
-    fdsAddr = ArenaPush(&fdsArena, sizeof(*fds));
+    fdsAddr = PushStruct(&fdsArena, struct pollfd);
     memcpy(fdsAddr, &newpollfd, sizeof(*fds));
+    // add restart socket, see listenRestart()
     newpollfd.fd = -1;
+    fdsAddr = PushStruct(&fdsArena, struct pollfd);
+    memcpy(fdsAddr, &newpollfd, sizeof(*fds));
     
     s32 clients_file;
 #ifdef IMPORT_ID
@@ -388,19 +2176,29 @@ main(int argc, char** argv)
     struct stat statbuf;
     assert(fstat(clients_file, &statbuf) != -1);
     
-    read(clients_file, clients, statbuf.st_size);
-    if (statbuf.st_size > 0)
+    if (!statbuf.st_size)
     {
-        ArenaPush(&clientsArena, statbuf.st_size);
-        LoggingF("Imported %lu client(s)\n", statbuf.st_size / sizeof(*clients));
-        nclients += statbuf.st_size / sizeof(*clients);
-        
-        // Reset pointers on imported clients
-        for (u32 i = 0; i < nclients - 1; i++)
+        ClientsHeader file_header = {CLIENTS_MAGIC, CLIENTS_VERSION};
+        s32 nwrite = write(clients_file, &file_header, sizeof(file_header));
+        assert(nwrite == sizeof(file_header));
+    }
+    else
+    {
+        u8* file = mmap(0, statbuf.st_size, PROT_READ, MAP_PRIVATE, clients_file, 0);
+        assert(file != MAP_FAILED);
+        ClientsHeader* file_header = (ClientsHeader*)file;
+        if ((u64)statbuf.st_size < sizeof(*file_header) || file_header->magic != CLIENTS_MAGIC ||
+            file_header->version != CLIENTS_VERSION)
         {
-            clients[i].unifd = 0;
-            clients[i].bifd = 0;
+            LoggingF("%s is not a version %u clients file, move it away to start without clients\n",
+                     CLIENTS_FILE, CLIENTS_VERSION);
+            return 1;
         }
+        
+        for (u64 at = sizeof(*file_header); at + AUTHOR_LEN <= (u64)statbuf.st_size; at += AUTHOR_LEN)
+            addClient(&registry, file + at);
+        munmap(file, statbuf.st_size);
+        LoggingF("Imported %u client(s)\n", nclients - 1);
     }
     for (u32 i = 0; i < nclients - 1; i++)
         LoggingF("Imported: " CLIENT_FMT "\n", CLIENT_ARG(clients[i]));
@@ -408,16 +2206,38 @@ main(int argc, char** argv)
     clients_file = 0;
 #endif
     
-    // Initialize the rest of the fds array
-    for (u32 i = FDS_CLIENTS; i < MAX_CONNECTIONS; i++)
-        fds[i] = newpollfd;
+    if (restart)
+    {
+        serverfd = takeOver(&registry, ring, detachedQueue, rooms, connections, &fdsArena, online,
+                            &inboxPool, &buffers, &heartbeats, &afkTimers);
+        if (serverfd == -1) return 1;
+        fds[FDS_SERVER].fd = serverfd;
+    }
+    fds[FDS_RESTART].fd = listenRestart();
+    if (fds[FDS_RESTART].fd == -1)
+        LoggingF("Could not listen on %s, errno: %d\n", RESTART_SOCKET, errno);
     
-    while (1)
+    u32 handedOff = 0;
+    while (!stopRequested)
 	{
-        s32 err = poll(fds, FDS_SIZE, TIMEOUT);
-        assert(err != -1);
+        u64 tick = getTimeMs() / TIMER_TICK;
+        expireAfk(&afkTimers, &presence, &registry, tick);
+        expireHeartbeats(&heartbeats, detachedQueue, &presence, online, tick);
+        
+        s32 timeout = expireDetached(detachedQueue, &presence, clients, nclients);
+        s32 presenceTimeout = flushPresence(&presence, ring, online, &sendArena);
+        if (presenceTimeout != -1 && (timeout == -1 || presenceTimeout < timeout))
+            timeout = presenceTimeout;
+        if (timeout == -1 || timeout > TIMEOUT) timeout = TIMEOUT;
+        // Wake up on the next tick for the timers
+        s32 tickTimeout = TIMER_TICK - getTimeMs() % TIMER_TICK;
+        if (tickTimeout < timeout) timeout = tickTimeout;
         
-        if (fds[FDS_STDIN].revents & POLLIN)
+        s32 err = poll(fds, FDS_SIZE, timeout);
+        assert(err != -1 || errno == EINTR);
+        if (err == -1) continue;
+        
+        if (fds[FDS_STDIN].revents & (POLLIN | POLLHUP))
         {
             u8 c; // exit on ctrl-d
             if (!read(fds[FDS_STDIN].fd, &c, 1))
@@ -425,155 +2245,366 @@ main(int argc, char** argv)
         }
         else if (fds[FDS_SERVER].revents & POLLIN)
         {
-            // TODO: what if we are not aligned by 2 anymore?
-            s32 clientfd = accept(serverfd, 0, 0);
-            
-            if (clientfd == -1)
-            {
-                LoggingF("Error while accepting connection (%d)\n", clientfd);
-                continue;
-            }
-            else
-                LoggingF("New connection(%d)\n", clientfd);
-            
-            // TODO: find empty space in arena (fragmentation)
-            if (nclients + 1 == MAX_CONNECTIONS)
+            u64 now = getTimeMs();
+            for (u32 accepted = 0; accepted < ACCEPT_BATCH; accepted++)
             {
-                local_persist HeaderMessage header = HEADER_INIT(HEADER_TYPE_ERROR);
-                local_persist ErrorMessage message = ERROR_INIT(ERROR_TYPE_TOOMANYCONNECTIONS);
-                sendAnyMessage(clientfd, header, &message);
-                if (clientfd != -1)
-                    close(clientfd);
-                LoggingF("Max clients reached. Rejected connection\n");
+                struct sockaddr_in address;
+                socklen_t addressLen = sizeof(address);
+                s32 clientfd = accept4(serverfd, (struct sockaddr*)&address, &addressLen, SOCK_CLOEXEC);
+                
+                if (clientfd == -1)
+                {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        LoggingF("Error while accepting connection, errno: %d\n", errno);
+                    break;
+                }
+                
+                u32 addr = ntohl(address.sin_addr.s_addr);
+                LoggingF("New connection(%d) from %s\n", clientfd, inet_ntoa(address.sin_addr));
+                
+                u32 retry = admitAddress(acceptBuckets, addr, now);
+                if (retry)
+                {
+                    rejectConnection(clientfd, retry);
+                    LoggingF("Too many connections from %s. Rejected connection\n", inet_ntoa(address.sin_addr));
+                }
+                else if (connections->count == MAX_CONNECTIONS)
+                {
+                    rejectConnection(clientfd, RETRY_AFTER);
+                    LoggingF("Max connections reached. Rejected connection\n");
+                }
+                else
+                {
+                    setKeepalive(clientfd);
+                    Connection* connection = addConnection(connections, &fdsArena, clientfd);
+                    TimerAdd(&heartbeats, &connection->heartbeat, tick + HEARTBEAT_INTERVAL / TIMER_TICK);
+                    LoggingF("Added pollfd(%d)\n", clientfd);
+                }
             }
-            else
+        }
+        
+        // A new server is taking over, messages that were not received yet are left to it
+        if (fds[FDS_RESTART].revents & POLLIN)
+        {
+            // The new server starts without pending presence changes, they are due right away
+            presence.start = 0;
+            flushPresence(&presence, ring, online, &sendArena);
+            if (handOff(fds[FDS_RESTART].fd, serverfd, &registry, ring, detachedQueue, rooms,
+                        connections, FDS_SIZE))
             {
-                // no more space, allocate
-                struct pollfd* pollfd = ArenaPush(&fdsArena, sizeof(*pollfd));
-                pollfd->fd = clientfd;
-                LoggingF("Added pollfd(%d)\n", clientfd);
+                handedOff = 1;
+                break;
             }
         }
         
         for (u32 conn = FDS_CLIENTS; conn < FDS_SIZE; conn++)
         {
+            Connection* connection = connections->polled[conn];
             if (!(fds[conn].revents & POLLIN)) continue;
-            if (fds[conn].fd == -1) continue;
-            LoggingF("Message(%d)\n", fds[conn].fd);
+            if (connection->fd == -1) continue;
+            LoggingF("Message(%d)\n", connection->fd);
             
             // We received a message, try to parse the header
             HeaderMessage header;
-            s32 nrecv = recv(fds[conn].fd, &header, sizeof(header), 0);
+            s32 nrecv = recv(connection->fd, &header, sizeof(header), 0);
             if(nrecv == -1)
             {
-                LoggingF("Received error from fd: %d, errno: %d\n", fds[conn].fd, errno);
+                LoggingF("Received error from fd: %d, errno: %d\n", connection->fd, errno);
             };
             
-            Client* client;
+            // Only the connection says who is acting, header.id is checked against it
+            Client* client = connection->client;
             if (nrecv != sizeof(header))
             {
-                client = getClientByFD(clients, nclients, fds[conn].fd);
                 if (client)
-                {
                     LoggingF("Received %d/%lu bytes "CLIENT_FMT"\n", nrecv, sizeof(header), CLIENT_ARG((*client)));
-                    disconnectAndNotify(clients, nclients, client);
-                }
                 else
-                {
                     LoggingF("Got error/disconnect from unauthenticated client\n");
-                    close(fds[conn].fd);
-                    fds[conn].fd = -1;
-                }
+                dropConnection(detachedQueue, &presence, online, connection);
                 continue;
             }
-            LoggingF("Received(%d): " HEADER_FMT "\n", fds[conn].fd, HEADER_ARG(header));
+            LoggingF("Received(%d): " HEADER_FMT "\n", connection->fd, HEADER_ARG(header));
+            connection->missed = 0;
+            TimerAdd(&heartbeats, &connection->heartbeat, tick + HEARTBEAT_INTERVAL / TIMER_TICK);
             
             // Authentication
-            if (!header.id)
+            if (!client)
             {
-                LoggingF("No client for connection(%d)\n", fds[conn].fd);
+                LoggingF("No client for connection(%d)\n", connection->fd);
                 
-                client = authenticate(&clientsArena, clients_file, fds + conn, header);
+                u32 replaced = 0;
+                client = authenticate(&registry, clients_file, ring, rooms, online, &sendArena, connection, header, &replaced);
                 
                 if (!client)
                 {
-                    LoggingF("Could not initialize client (%d)\n", fds[conn].fd);
-                    close(fds[conn].fd);
-                    fds[conn].fd = -1;
+                    LoggingF("Could not initialize client (%d)\n", connection->fd);
+                    dropConnection(detachedQueue, &presence, online, connection);
                 }
-                /* This is the first time a message is sent, because unifd is not yet set. */
-                else if (!client->unifd)
+                /* Others already know about the client if it only replaced its connection. */
+                else if (!replaced)
+                    queuePresence(&presence, client, PRESENCE_TYPE_CONNECTED);
+                
+                // A resumed session gets the presence changes it missed replayed instead
+                if (client && header.type != HEADER_TYPE_RESUME)
+                    sendRoster(online, &sendArena, client);
+                if (client)
                 {
-                    LoggingF("Send connected message\n");
-                    local_persist HeaderMessage header = HEADER_INIT(HEADER_TYPE_PRESENCE);
-                    header.id = client->id;
-                    PresenceMessage message = {.type = PRESENCE_TYPE_CONNECTED};
-                    sendToOthers(clients, nclients, client, UNIFD, &header, &message);
+                    sendInbox(ring, rooms, &sendArena, &scratchArena, &inboxPool, client);
+                    TimerAdd(&afkTimers, &client->info->afk, tick + AFK_TIMEOUT / TIMER_TICK);
                 }
                 continue;
             }
             
-            client = getClientByID(clients, nclients, header.id);
-            if (!client)
+            if (header.id != client->id)
             {
-                LoggingF("No client for id %d\n", fds[conn].fd);
+                LoggingF("Wrong id %lu from "CLIENT_FMT"\n", header.id, CLIENT_ARG((*client)));
                 
-                header.type = HEADER_TYPE_ERROR;
-                ErrorMessage message = ERROR_INIT(ERROR_TYPE_NOTFOUND);
+                sendError(connection->fd, header.request, 0, ERROR_TYPE_BADMESSAGE, 0);
                 
-                sendAnyMessage(fds[conn].fd, header, &message);
-                
-                // Reject connection
-                fds[conn].fd = -1;
-                close(fds[conn].fd);
+                // The message that follows is not read, so the stream cannot be trusted anymore
+                dropConnection(detachedQueue, &presence, online, connection);
                 continue;
             }
             
             switch (header.type) {
-                /* Send text message to all other clients */
+                /* Send text message to all other clients in the room */
                 case HEADER_TYPE_TEXT:
                 {
-                    TextMessage* text_message = recvTextMessage(&msgsArena, fds[conn].fd);
-                    LoggingF("Received(%d): ", fds[conn].fd);
+                    // Sends complete before the next message is handled, so this reference
+                    // covers the fan-out.  Ring and inbox take their own.
+                    u32 size;
+                    MessageBuffer* buffer = recvBuffer(&buffers, connection->fd, &size);
+                    if (!buffer)
+                    {
+                        // Would never fit in the bucket, waiting does not help
+                        if (size > TEXT_BURST)
+                        {
+                            LoggingF("Text of %u bytes too large from "CLIENT_FMT"\n", size, CLIENT_ARG((*client)));
+                            sendError(connection->fd, header.request, 0, ERROR_TYPE_BADMESSAGE, 0);
+                        }
+                        else
+                        {
+                            LoggingF("No buffer for text of %u bytes from "CLIENT_FMT"\n", size, CLIENT_ARG((*client)));
+                            sendError(connection->fd, header.request, 0, ERROR_TYPE_TOOMANYMESSAGES, RETRY_AFTER);
+                        }
+                        break;
+                    }
+                    TextMessage* text_message = &buffer->text;
+                    LoggingF("Received(%d): ", connection->fd);
                     printTextMessage(text_message, client, 0);
                     
-                    sendToOthers(clients, nclients, client, UNIFD, &header, text_message);
+                    // Direct message
+                    Client* recipient = 0;
+                    if (text_message->to)
+                    {
+                        recipient = getClientByID(clients, nclients, text_message->to);
+                        if (!recipient)
+                        {
+                            LoggingF("No recipient %lu for "CLIENT_FMT"\n", text_message->to, CLIENT_ARG((*client)));
+                            releaseBuffer(buffer);
+                            
+                            sendError(connection->fd, header.request, 0, ERROR_TYPE_NOTFOUND, 0);
+                            break;
+                        }
+                    }
+                    
+                    Room* room = 0;
+                    if (!recipient && text_message->room)
+                    {
+                        room = getRoom(rooms, text_message->room, 0);
+                        if (!room || findRoomMember(room, client) == -1)
+                        {
+                            LoggingF("Not in room %u "CLIENT_FMT"\n", text_message->room, CLIENT_ARG((*client)));
+                            releaseBuffer(buffer);
+                            
+                            sendError(connection->fd, header.request, 0, ERROR_TYPE_NOTFOUND, 0);
+                            break;
+                        }
+                    }
+                    
+                    u32 retry = limitClient(client, size, getTimeMs());
+                    if (retry)
+                    {
+                        // Forget the message
+                        releaseBuffer(buffer);
+                        client->info->dropped++;
+                        metrics.droppedMessages++;
+                        metrics.droppedBytes += size;
+                        LoggingF("Dropped message from "CLIENT_FMT" (%u), total %lu messages %lu bytes\n",
+                                 CLIENT_ARG((*client)), client->info->dropped,
+                                 metrics.droppedMessages, metrics.droppedBytes);
+                        
+                        sendError(connection->fd, header.request, 0, ERROR_TYPE_TOOMANYMESSAGES, retry);
+                        break;
+                    }
+                    
+                    // Only a text that is delivered counts as activity
+                    TimerAdd(&afkTimers, &client->info->afk, tick + AFK_TIMEOUT / TIMER_TICK);
+                    if (client->info->away)
+                    {
+                        LoggingF("Back "CLIENT_FMT"\n", CLIENT_ARG((*client)));
+                        client->info->away = 0;
+                        queuePresence(&presence, client, PRESENCE_TYPE_BACK);
+                    }
+                    
+                    // Nothing of the sender's header is passed on, see "Acknowledgements"
+                    HeaderMessage text_header = HEADER_INIT(HEADER_TYPE_TEXT);
+                    text_header.id = client->id;
+                    if (recipient)
+                    {
+                        // Not recorded, direct messages are kept in the inbox instead
+                        s32 nsend = -1;
+                        if (recipient->conn && recipient->conn->fd != -1)
+                            nsend = sendAnyMessage(recipient->conn->fd, text_header, text_message);
+                        if (nsend == -1 && !queueInbox(&inboxPool, recipient, &text_header, buffer))
+                        {
+                            LoggingF("No inbox entry for "CLIENT_FMT"\n", CLIENT_ARG((*recipient)));
+                            sendError(connection->fd, header.request, 0, ERROR_TYPE_TOOMANYMESSAGES, RETRY_AFTER);
+                        }
+                        releaseBuffer(buffer);
+                        break;
+                    }
+                    
+                    recordMessage(ring, &text_header, buffer);
+                    if (room)
+                        sendToRoom(room, client, &text_header, text_message);
+                    else
+                        sendToOthers(online, client, &text_header, text_message);
+                    releaseBuffer(buffer);
+                } break;
+                /* Join or leave a room */
+                case HEADER_TYPE_ROOM:
+                {
+                    RoomMessage room_message;
+                    s32 nrecv = recv(connection->fd, &room_message, sizeof(room_message), MSG_WAITALL);
+                    assert(nrecv == sizeof(room_message));
+                    
+                    ErrorMessage message = ERROR_INIT(ERROR_TYPE_SUCCESS);
+                    if (!room_message.room)
+                    {
+                        message.type = ERROR_TYPE_BADMESSAGE;
+                    }
+                    else if (room_message.type == ROOM_TYPE_JOIN)
+                        message.type = joinRoom(rooms, room_message.room, client);
+                    else
+                        message.type = leaveRoom(rooms, room_message.room, client);
+                    LoggingF("Room %u %s "CLIENT_FMT": %s\n", room_message.room,
+                             (room_message.type == ROOM_TYPE_JOIN) ? "join" : "leave",
+                             CLIENT_ARG((*client)), errorTypeString(message.type));
+                    
+                    sendError(connection->fd, header.request, 0, message.type, 0);
+                } break;
+                /* Acknowledged notifications, send the missing ones again */
+                case HEADER_TYPE_ACK:
+                {
+                    AckMessage ack_message;
+                    s32 nrecv = recv(connection->fd, &ack_message, sizeof(ack_message), MSG_WAITALL);
+                    assert(nrecv == sizeof(ack_message));
+                    if (ack_message.seq > ring->seq)
+                        ack_message.seq = ring->seq;
+                    if (ack_message.seq > client->info->acked)
+                        client->info->acked = ack_message.seq;
+                    
+                    if (ack_message.type == ACK_TYPE_MISSING)
+                    {
+                        LoggingF("Missing after %lu "CLIENT_FMT"\n", ack_message.seq, CLIENT_ARG((*client)));
+                        // The client takes the next notification as is
+                        if (!replayMessages(ring, rooms, &sendArena, client, ack_message.seq))
+                            client->sent = 0;
+                    }
+                } break;
+                /* Heartbeats, receiving them already reset the connection's timer */
+                case HEADER_TYPE_PING:
+                {
+                    PingMessage message;
+                    s32 nrecv = recv(connection->fd, &message, sizeof(message), MSG_WAITALL);
+                    assert(nrecv == sizeof(message));
+                    
+                    HeaderMessage pong_header = HEADER_INIT(HEADER_TYPE_PONG);
+                    sendAnyMessage(connection->fd, pong_header, &message);
+                } break;
+                case HEADER_TYPE_PONG:
+                {
+                    PingMessage message;
+                    s32 nrecv = recv(connection->fd, &message, sizeof(message), MSG_WAITALL);
+                    assert(nrecv == sizeof(message));
+                    LoggingF("Pong after %lums "CLIENT_FMT"\n", getTimeMs() - message.timestamp,
+                             CLIENT_ARG((*client)));
                 } break;
                 /* Send back client information */
                 case HEADER_TYPE_ID:
                 {
                     IDMessage id_message;
-                    s32 nrecv = recv(fds[conn].fd, &id_message, sizeof(id_message), 0);
+                    s32 nrecv = recv(connection->fd, &id_message, sizeof(id_message), 0);
                     assert(nrecv == sizeof(id_message));
                     
-                    client = getClientByID(clients, nclients, id_message.id);
-                    if (!client)
+                    Client* found = getClientByID(clients, nclients, id_message.id);
+                    if (!found)
                     {
-                        header.type = HEADER_TYPE_ERROR;
-                        ErrorMessage message = ERROR_INIT(ERROR_TYPE_NOTFOUND);
-                        s32 nsend = sendAnyMessage(fds[conn].fd, header, &message);
-                        assert(nsend != -1);
+                        sendError(connection->fd, header.request, id_message.id, ERROR_TYPE_NOTFOUND, 0);
                         break;
                     }
                     
+                    u32 request = header.request;
                     HeaderMessage header = HEADER_INIT(HEADER_TYPE_INTRODUCTION);
+                    header.request = request;
                     IntroductionMessage introduction_message;
-                    header.id = client->id;
-                    memcpy(introduction_message.author, client->author, AUTHOR_LEN);
+                    header.id = found->id;
+                    memcpy(introduction_message.author, found->info->author, AUTHOR_LEN);
                     
-                    nrecv = sendAnyMessage(fds[conn].fd, header, &introduction_message);
-                    assert(nrecv != -1);
+                    sendAnyMessage(connection->fd, header, &introduction_message);
+                } break;
+                /* Send back information for each client in the list */
+                case HEADER_TYPE_IDLIST:
+                {
+                    IDListMessage idlist_message;
+                    s32 nrecv = recv(connection->fd, &idlist_message, sizeof(idlist_message), 0);
+                    assert(nrecv == sizeof(idlist_message));
+                    if (idlist_message.len > IDLIST_MAX)
+                        idlist_message.len = IDLIST_MAX;
+
+                    for (u32 i = 0; i < idlist_message.len; i++)
+                    {
+                        ID id = idlist_message.ids[i];
+                        Client* found = getClientByID(clients, nclients, id);
+                        s32 nsend;
+                        if (!found)
+                        {
+                            nsend = sendError(connection->fd, header.request, id, ERROR_TYPE_NOTFOUND, 0);
+                        }
+                        else
+                        {
+                            HeaderMessage introduction_header = HEADER_INIT(HEADER_TYPE_INTRODUCTION);
+                            introduction_header.request = header.request;
+                            introduction_header.id = found->id;
+                            IntroductionMessage introduction_message;
+                            memcpy(introduction_message.author, found->info->author, AUTHOR_LEN);
+                            nsend = sendAnyMessage(connection->fd, introduction_header, &introduction_message);
+                        }
+                        if (nsend == -1) break;
+                    }
+                    LoggingF("Answered %d id(s) for "CLIENT_FMT"\n", idlist_message.len, CLIENT_ARG((*client)));
                 } break;
                 default:
                 LoggingF("Unhandled '%s' from "CLIENT_FMT"(%d)\n", headerTypeString(header.type),
                          CLIENT_ARG((*client)),
-                         fds[conn].fd);
-                disconnectAndNotify(client, nclients, client);
+                         connection->fd);
+                disconnectAndNotify(&presence, online, client);
                 continue;
             }
         }
+        
+        compactConnections(connections, &fdsArena);
     }
     
+    if (handedOff)
+        LoggingF("Exiting, the new server took over\n");
+    else
+        drainServer(fds, FDS_SIZE, connections, &presence, ring, online, &sendArena);
+    
+    LoggingF("Dropped %lu messages, %lu bytes\n", metrics.droppedMessages, metrics.droppedBytes);
+    
+    close(ring->logfd);
 #ifdef IMPORT_ID
     close(clients_file);
 #endif
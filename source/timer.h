@@ -0,0 +1,137 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "chatty.h"
+
+// Slots per level, must be a power of two
+#define TIMER_SLOTS_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOTS_BITS)
+#define TIMER_LEVELS 4
+// Timers further away than this are put at the end of the last level, they are put back in the
+// wheel when they get there
+#define TIMER_MAX (((u64)1 << (TIMER_SLOTS_BITS * TIMER_LEVELS)) - 1)
+
+// Timer Wheel
+// Schedules timers in ticks, the caller decides how long a tick is.  A slot on level 0 holds
+// the timers expiring on one tick, a slot on a higher level spans all slots of the level below.
+// When the level below wraps around the timers in the next slot move down, so adding, removing
+// and expiring a timer take constant time no matter how many are scheduled.
+// Timers are embedded in the structs they belong to, see TimerAdvance() for getting them back.
+typedef struct Timer Timer;
+struct Timer {
+    Timer* next;
+    Timer** prev;  // pointer pointing to this timer, 0 when not scheduled
+    u64 expires;   // tick
+};
+
+typedef struct {
+    Timer* slots[TIMER_LEVELS][TIMER_SLOTS];
+    u64 now;       // last tick that was advanced to
+} TimerWheel;
+
+void TimerWheelInit(TimerWheel* wheel, u64 now);
+void TimerAdd(TimerWheel* wheel, Timer* timer, u64 expires);
+void TimerRemove(Timer* timer);
+Timer* TimerAdvance(TimerWheel* wheel, u64 now);
+
+#endif // TIMER_H
+
+#ifdef TIMER_IMPL
+
+void
+TimerWheelInit(TimerWheel* wheel, u64 now)
+{
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->now = now;
+}
+
+// Put timer in the slot for its expiry, which must not be before wheel->now.
+void
+TimerInsert(TimerWheel* wheel, Timer* timer)
+{
+    u64 delta = timer->expires - wheel->now;
+    if (delta > TIMER_MAX)
+        delta = TIMER_MAX;
+
+    u32 level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= ((u64)1 << (TIMER_SLOTS_BITS * (level + 1))))
+        level++;
+    u32 slot = ((wheel->now + delta) >> (TIMER_SLOTS_BITS * level)) & (TIMER_SLOTS - 1);
+
+    Timer** head = &wheel->slots[level][slot];
+    timer->next = *head;
+    if (*head)
+        (*head)->prev = &timer->next;
+    *head = timer;
+    timer->prev = head;
+}
+
+// Schedule timer to expire on tick expires, or on the next tick if expires already passed.  A
+// scheduled timer is moved.
+void
+TimerAdd(TimerWheel* wheel, Timer* timer, u64 expires)
+{
+    TimerRemove(timer);
+    timer->expires = (expires > wheel->now) ? expires : wheel->now + 1;
+    TimerInsert(wheel, timer);
+}
+
+// Unschedule timer if it is scheduled.
+void
+TimerRemove(Timer* timer)
+{
+    if (!timer->prev) return;
+
+    *timer->prev = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+    timer->next = 0;
+    timer->prev = 0;
+}
+
+// Advance wheel to tick now.
+// Returns the timers that expired linked through next, they are no longer scheduled so they can
+// be added again while going through the list.  Get the struct a timer is embedded in with
+// offsetof().
+Timer*
+TimerAdvance(TimerWheel* wheel, u64 now)
+{
+    Timer* expired = 0;
+    while (wheel->now < now)
+    {
+        wheel->now++;
+
+        // Move timers down from the levels that wrapped, the highest first so they can move down
+        // more than one level
+        for (u32 level = TIMER_LEVELS - 1; level > 0; level--)
+        {
+            if (wheel->now & (((u64)1 << (TIMER_SLOTS_BITS * level)) - 1)) continue;
+
+            u32 slot = (wheel->now >> (TIMER_SLOTS_BITS * level)) & (TIMER_SLOTS - 1);
+            Timer* timer = wheel->slots[level][slot];
+            wheel->slots[level][slot] = 0;
+            while (timer)
+            {
+                Timer* next = timer->next;
+                TimerInsert(wheel, timer);
+                timer = next;
+            }
+        }
+
+        u32 slot = wheel->now & (TIMER_SLOTS - 1);
+        Timer* timer = wheel->slots[0][slot];
+        wheel->slots[0][slot] = 0;
+        while (timer)
+        {
+            Timer* next = timer->next;
+            timer->prev = 0;
+            timer->next = expired;
+            expired = timer;
+            timer = next;
+        }
+    }
+    return expired;
+}
+
+#undef TIMER_IMPL
+#endif // TIMER_IMPL
@@ -57,7 +57,9 @@ bool is_whitespace(u32 ch);
 bool is_markdown(u32 ch);
 void tb_print_wrapped(u32 X, u32 Y, u32 XLimit, u32 YLimit, u32* Text, u32 Len);
 void tb_print_markdown(u32 X, u32 Y, u32 fg, u32 bg, u32* Text, u32 Len);
-u32 tb_print_wrapped_with_markdown(u32 XOffset, u32 YOffset, u32 fg, u32 bg,
+u32 tb_wrap_positions(u32* Text, u32 Len, u32 XLimit, u32* WrapPositions);
+u32 tb_wrapped_lines_count(u32* Text, u32 Len, u32 XLimit);
+u32 tb_print_wrapped_with_markdown(u32 XOffset, s32 YOffset, u32 fg, u32 bg,
                                    u32* Text, u32 Len,
                                    u32 XLimit, u32 YLimit,
                                    markdown_formatoptions MDFormat);
@@ -671,33 +673,20 @@ tb_print_wrapped(u32 X, u32 Y, u32 XLimit, u32 YLimit, u32* Text, u32 Len)
     tb_printf(X, Y++, 0, 0, "%ls", Text + PrevI);
 }
 
-// Print raw string with markdown format options in `MDFormat`, wrapped at
-// `XLimit` and `YLimit`.  The string is offset by `XOffset` and `YOffset`.
-// `fg` and `bg` are passed to `tb_printf`.
-// `Len` is the length of the string not including a null terminator
+// Fill `WrapPositions` with the positions in `Text`, `Len` characters long, where it should be
+// wrapped at `XLimit` width.  `WrapPositions` may be null to only count them.
 // The wrapping algorithm searches for a whitespace backwards and if none are found it wraps at
 // `XLimit`.
-// This function first builds an array of positions where to wrap and then prints `Text` by
-// character using the array in `MDFormat.Options` and `WrapPositions` to know when to act.
-// Returns how many times wrapped
+// Returns the number of wrap positions
 u32
-tb_print_wrapped_with_markdown(u32 XOffset, u32 YOffset, u32 fg, u32 bg,
-                               u32* Text, u32 Len,
-                               u32 XLimit, u32 YLimit,
-                               markdown_formatoptions MDFormat)
+tb_wrap_positions(u32* Text, u32 Len, u32 XLimit, u32* WrapPositions)
 {
-    XLimit -= XOffset;
-    YLimit -= YOffset;
-    Assert(YLimit > 0);
     Assert(XLimit > 0);
 
     u32 TextIndex = XLimit;
     u32 PrevTextIndex = 0;
-
-    u32 WrapPositions[Len/XLimit + 1];
     u32 WrapPositionsLen = 0;
 
-    // Get wrap positions
     while (TextIndex < Len)
     {
         while (!is_whitespace(Text[TextIndex]))
@@ -711,16 +700,50 @@ tb_print_wrapped_with_markdown(u32 XOffset, u32 YOffset, u32 fg, u32 bg,
             }
         }
 
-        WrapPositions[WrapPositionsLen] = TextIndex;
+        if (WrapPositions) WrapPositions[WrapPositionsLen] = TextIndex;
         WrapPositionsLen++;
 
         PrevTextIndex = TextIndex;
         TextIndex += XLimit;
     }
 
+    return WrapPositionsLen;
+}
+
+// Returns the number of lines `tb_print_wrapped_with_markdown()` uses to print `Text`, `Len`
+// characters long, wrapped at `XLimit` width.
+u32
+tb_wrapped_lines_count(u32* Text, u32 Len, u32 XLimit)
+{
+    return tb_wrap_positions(Text, Len, XLimit, 0) + 1;
+}
+
+// Print raw string with markdown format options in `MDFormat`, wrapped at
+// `XLimit` and `YLimit`.  The string is offset by `XOffset` and `YOffset`.
+// `YOffset` can be negative, lines above the screen are skipped, this is used for printing
+// messages that are only partially visible.
+// `fg` and `bg` are passed to `tb_printf`.
+// `Len` is the length of the string not including a null terminator
+// This function first builds an array of positions where to wrap and then prints `Text` by
+// character using the array in `MDFormat.Options` and `WrapPositions` to know when to act.
+// Returns how many times wrapped
+u32
+tb_print_wrapped_with_markdown(u32 XOffset, s32 YOffset, u32 fg, u32 bg,
+                               u32* Text, u32 Len,
+                               u32 XLimit, u32 YLimit,
+                               markdown_formatoptions MDFormat)
+{
+    XLimit -= XOffset;
+    Assert(YLimit > 0);
+    Assert(XLimit > 0);
+
+    u32 WrapPositions[Len + 1];
+    u32 WrapPositionsLen = tb_wrap_positions(Text, Len, XLimit, WrapPositions);
+
     u32 MDFormatOptionsIndex = 0;
     u32 WrapPositionsIndex = 0;
-    u32 X = XOffset, Y = YOffset;
+    u32 X = XOffset;
+    s32 Y = YOffset;
 
     for (u32 TextIndex = 0; TextIndex < Len; TextIndex++)
     {
@@ -734,12 +757,14 @@ tb_print_wrapped_with_markdown(u32 XOffset, u32 YOffset, u32 fg, u32 bg,
             TextIndex == WrapPositions[WrapPositionsIndex])
         {
             Y++;
-            if (Y == YLimit) return WrapPositionsIndex + 1;
+            if (Y == (s32)YLimit) return WrapPositionsIndex + 1;
             WrapPositionsIndex++;
             X = XOffset;
             if (is_whitespace(Text[TextIndex])) continue;
         }
-        tb_printf(X++, Y, fg, bg, "%lc", Text[TextIndex]);
+        if (Y >= 0)
+            tb_printf(X, Y, fg, bg, "%lc", Text[TextIndex]);
+        X++;
     }
     Assert(WrapPositionsIndex == WrapPositionsLen);
     Assert(MDFormat.Len == MDFormatOptionsIndex);
@@ -758,7 +783,7 @@ markdown_to_raw(Arena* ScratchArena, wchar_t* Text, u32 Len)
     raw_result Result = {0};
     if (ScratchArena)
     {
-        Result.Text = ScratchArena->addr;
+        Result.Text = (u32*)((u8*)ScratchArena->addr + ScratchArena->pos);
     }
 
     for (u32 i = 0; i < Len; i++)
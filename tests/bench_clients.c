@@ -0,0 +1,206 @@
+// Benchmark for the client registry in server.c with 100k registered clients.  Compares the
+// split Client/ClientInfo layout against the single struct it replaced on:
+// - lookups by id reading the fields a send needs
+// - a broadcast over the online clients in no particular order
+// - a scan over every registered client
+#define main server_main
+#include "../source/server.c"
+#undef main
+
+#define BENCH_CLIENTS 100000
+#define BENCH_LOOKUPS 10000000
+#define BENCH_ONLINE 20000
+#define BENCH_ROUNDS 20
+#define BENCH_TRIALS 5
+
+// Client as it was before the split
+typedef struct {
+    u8 author[AUTHOR_LEN];
+    ID id;
+    Connection* conn;
+    u64 token;
+    u64 detached;
+    TokenBucket messages;
+    TokenBucket text;
+    u32 dropped;
+    u32 online;
+    InboxEntry* inbox;
+    InboxEntry* inboxLast;
+    u64 offline;
+    u64 sent;
+    u64 acked;
+} FatClient;
+
+// Returns time in nanoseconds
+u64
+getTimeNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift, the same sequence for both layouts
+u32
+nextRandom(u32* state)
+{
+    u32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+global_variable Client* clients;
+global_variable FatClient* fat;
+global_variable Client** online;
+global_variable FatClient** fatOnline;
+global_variable u64 sum;
+
+void
+lookupFat(void)
+{
+    u32 seed = 7;
+    for (u32 i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        FatClient* client = fat + nextRandom(&seed) % BENCH_CLIENTS;
+        if (client->conn) sum += client->sent + client->id;
+    }
+}
+
+void
+lookupSplit(void)
+{
+    u32 seed = 7;
+    for (u32 i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        Client* client = getClientByID(clients, nclients, nextRandom(&seed) % BENCH_CLIENTS + 1);
+        if (client->conn) sum += client->sent + client->id;
+    }
+}
+
+// What sendNotification() touches for each online client
+void
+broadcastFat(void)
+{
+    for (u32 round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (u32 i = 0; i < BENCH_ONLINE; i++)
+        {
+            FatClient* client = fatOnline[i];
+            sum += client->conn->fd + client->sent;
+            client->sent = round;
+        }
+    }
+}
+
+void
+broadcastSplit(void)
+{
+    for (u32 round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (u32 i = 0; i < BENCH_ONLINE; i++)
+        {
+            Client* client = online[i];
+            sum += client->conn->fd + client->sent;
+            client->sent = round;
+        }
+    }
+}
+
+void
+scanFat(void)
+{
+    for (u32 round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (u32 i = 0; i < BENCH_CLIENTS; i++)
+            sum += fat[i].online;
+    }
+}
+
+void
+scanSplit(void)
+{
+    for (u32 round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (u32 i = 0; i < BENCH_CLIENTS; i++)
+            sum += clients[i].online;
+    }
+}
+
+// Returns the fastest of BENCH_TRIALS runs of bench in nanoseconds
+u64
+timeBest(void (*bench)(void))
+{
+    u64 best = -1;
+    for (u32 trial = 0; trial < BENCH_TRIALS; trial++)
+    {
+        u64 start = getTimeNs();
+        bench();
+        u64 elapsed = getTimeNs() - start;
+        if (elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+void
+printResult(char* name, void (*benchFat)(void), void (*benchSplit)(void), u64 count)
+{
+    u64 fatNs = timeBest(benchFat);
+    u64 splitNs = timeBest(benchSplit);
+    printf("%-10s fat %7.2f ns  split %7.2f ns  speedup %.2fx\n", name,
+           (double)fatNs / count, (double)splitNs / count, (double)fatNs / splitNs);
+}
+
+int
+main(void)
+{
+    LogFD = open("/dev/null", O_WRONLY);
+
+    Registry registry;
+    ArenaAlloc(&registry.clients, CLIENTS_MAX * sizeof(Client));
+    ArenaAlloc(&registry.infos, CLIENTS_MAX * sizeof(ClientInfo));
+    fat = mmap(0, BENCH_CLIENTS * sizeof(*fat), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(fat != MAP_FAILED);
+
+    Connection connection = {.fd = 3, .client = 0};
+    for (u32 i = 0; i < BENCH_CLIENTS; i++)
+    {
+        u8 author[AUTHOR_LEN] = {0};
+        snprintf((char*)author, AUTHOR_LEN, "user%u", i);
+        Client* client = addClient(&registry, author);
+        memcpy(fat[i].author, author, AUTHOR_LEN);
+        fat[i].id = client->id;
+        if (i % (BENCH_CLIENTS / BENCH_ONLINE) == 0)
+        {
+            client->conn = fat[i].conn = &connection;
+            client->online = fat[i].online = 1;
+        }
+    }
+    clients = registry.clients.addr;
+
+    // Online clients are added and removed over time, so they end up in random order
+    online = malloc(BENCH_ONLINE * sizeof(*online));
+    fatOnline = malloc(BENCH_ONLINE * sizeof(*fatOnline));
+    u32 seed = 1;
+    for (u32 i = 0; i < BENCH_ONLINE; i++)
+    {
+        u32 index = i * (BENCH_CLIENTS / BENCH_ONLINE);
+        online[i] = clients + index;
+        fatOnline[i] = fat + index;
+    }
+    for (u32 i = BENCH_ONLINE - 1; i > 0; i--)
+    {
+        u32 j = nextRandom(&seed) % (i + 1);
+        Client* swap = online[i]; online[i] = online[j]; online[j] = swap;
+        FatClient* fatSwap = fatOnline[i]; fatOnline[i] = fatOnline[j]; fatOnline[j] = fatSwap;
+    }
+
+    printResult("lookup", lookupFat, lookupSplit, BENCH_LOOKUPS);
+    printResult("broadcast", broadcastFat, broadcastSplit, (u64)BENCH_ROUNDS * BENCH_ONLINE);
+    printResult("scan", scanFat, scanSplit, (u64)BENCH_ROUNDS * BENCH_CLIENTS);
+
+    printf("%lu clients, Client %lu bytes, ClientInfo %lu bytes, old Client %lu bytes (%lu)\n",
+           (u64)BENCH_CLIENTS, sizeof(Client), sizeof(ClientInfo), sizeof(FatClient), sum & 1);
+    return 0;
+}
@@ -10,3 +10,6 @@ gcc -ggdb -Wall $WarningFlags -o tests tests.c
 
 # printf 'archived/input_box.c\n'
 # gcc -DDEBUG -ggdb -Wall -pedantic -std=c11 -I external -I . -o "$BuildDir"/input_box archived/input_box.c
+
+printf 'bench_clients.c\n'
+gcc -O2 -Wall $WarningFlags -Wno-unused-function -o bench_clients bench_clients.c
@@ -2,6 +2,7 @@
 
 #define TB_IMPL
 #include "../source/termbox2.h"
+#define CHATTY_IMPL
 #include "../source/chatty.h"
 
 #define TEST_IMPL
@@ -9,6 +10,12 @@
 
 #define Assert(expr) if (!(expr)) *(u8*)0 = 0
 
+#define ARENA_IMPL
+#include "../source/arena.h"
+#include "../source/protocol.h"
+#define TIMER_IMPL
+#include "../source/timer.h"
+
 bool
 DrawingTest(void)
 {
@@ -17,11 +24,296 @@ DrawingTest(void)
     return true;
 }
 
+// Push a TextMessage with Len characters of Text, including the null terminator, on Arena_
+TextMessage*
+PushText(Arena* Arena_, u64 Timestamp, RoomID Room, ID To, wchar_t* Text, u32 Len)
+{
+    TextMessage* Message = ArenaPushAligned(Arena_, TEXTMESSAGE_SIZE, _Alignof(TextMessage));
+    Message->timestamp = Timestamp;
+    Message->len = Len;
+    Message->room = Room;
+    Message->to = To;
+    memcpy(ArenaPush(Arena_, Len * sizeof(wchar_t)), Text, Len * sizeof(wchar_t));
+    return Message;
+}
+
+// Returns true if the header and message decoded from a batch are the same as the ones pushed
+bool
+EntryCmp(HeaderMessage* Entry, HeaderMessage* Header, void* Message, u64 Prev)
+{
+    if (Entry->type != Header->type || Entry->seq != Header->seq || Entry->id != Header->id ||
+        Entry->prev != Prev || Entry->request || Entry->version != PROTOCOL_VERSION)
+        return false;
+    
+    if (Header->type == HEADER_TYPE_PRESENCE)
+        return !memcmp(Entry + 1, Message, sizeof(PresenceMessage));
+    
+    TextMessage* Text = Message;
+    TextMessage* Decoded = (TextMessage*)(Entry + 1);
+    return (Decoded->timestamp == Text->timestamp && Decoded->room == Text->room &&
+            Decoded->to == Text->to && Decoded->len == Text->len &&
+            !memcmp(&Decoded->text, &Text->text, Text->len * sizeof(wchar_t)));
+}
+
+// Sequence numbers, IDs and timestamps that go down between entries are encoded as negative
+// differences, see "Batches" in protocol.h
+bool
+BatchRoundTripTest(void)
+{
+    Arena Messages, Out, In;
+    ArenaAlloc(&Messages, Megabytes(1));
+    ArenaAlloc(&Out, Megabytes(1));
+    ArenaAlloc(&In, Megabytes(1));
+    
+    HeaderMessage Headers[5];
+    void* Bodies[5];
+    for (u32 i = 0; i < 5; i++) Headers[i] = (HeaderMessage)HEADER_INIT(HEADER_TYPE_TEXT);
+    
+    Headers[0].seq = 100; Headers[0].id = 7;
+    Bodies[0] = PushText(&Messages, 1700000000, 3, 0, L"first", 6);
+    // Presence changes are not numbered
+    Headers[1].type = HEADER_TYPE_PRESENCE; Headers[1].seq = 0; Headers[1].id = 2;
+    PresenceMessage* Presence = PushStruct(&Messages, PresenceMessage);
+    *Presence = (PresenceMessage){.type = PRESENCE_TYPE_AFK, .author = "bob"};
+    Bodies[1] = Presence;
+    Headers[2].seq = 101; Headers[2].id = 1;
+    Bodies[2] = PushText(&Messages, 1600000000, 0, 9, L"older", 6);
+    // Largest differences there are
+    Headers[3].seq = (u64)-1; Headers[3].id = (ID)-1;
+    Bodies[3] = PushText(&Messages, (u64)-1, (RoomID)-1, (ID)-1, L"", 1);
+    Headers[4].seq = 1; Headers[4].id = 1;
+    Bodies[4] = PushText(&Messages, 0, 0, 0, L"x", 2);
+    
+    Batch Batch_;
+    batchBegin(&Batch_, &Out, 55);
+    for (u32 i = 0; i < 5; i++)
+        batchPush(&Batch_, &Out, Headers + i, Bodies[i]);
+    
+    // Read it back the way the client receives it
+    HeaderMessage Header;
+    BatchMessage Message;
+    memcpy(&Header, Out.addr, sizeof(Header));
+    memcpy(&Message, (u8*)Out.addr + sizeof(Header), sizeof(Message));
+    u8* Entries = (u8*)Out.addr + sizeof(Header) + sizeof(Message);
+    Expect(Header.type == HEADER_TYPE_BATCH && Header.prev == 55 && !Header.seq);
+    Expect(Message.count == 5);
+    Expect(sizeof(Header) + sizeof(Message) + Message.size == Out.pos);
+    
+    BatchReader Reader;
+    batchRead(&Reader, &Header, &Message, Entries);
+    u64 Prev = 55;
+    for (u32 i = 0; i < 5; i++)
+    {
+        HeaderMessage* Entry = batchNext(&Reader, &In);
+        Expect(Entry);
+        Expect(EntryCmp(Entry, Headers + i, Bodies[i], Prev));
+        Prev = Headers[i].seq;
+    }
+    Expect(!batchNext(&Reader, &In));
+    
+    // A cut off entry is not decoded
+    ArenaReset(&In);
+    Message.size--;
+    batchRead(&Reader, &Header, &Message, Entries);
+    for (u32 i = 0; i < 4; i++)
+        Expect(batchNext(&Reader, &In));
+    Expect(!batchNext(&Reader, &In));
+    
+    ArenaRelease(&Messages);
+    ArenaRelease(&Out);
+    ArenaRelease(&In);
+    return true;
+}
+
+// Fill batches the way the server does, a new one is started when the next entry might not fit
+// in BATCH_SIZE
+bool
+BatchFullTest(void)
+{
+    Arena Messages, Out, In;
+    ArenaAlloc(&Messages, Megabytes(1));
+    ArenaAlloc(&Out, Megabytes(4));
+    ArenaAlloc(&In, Megabytes(1));
+    
+    wchar_t Text[1000];
+    for (u32 i = 0; i < 999; i++) Text[i] = L'a' + i % 26;
+    Text[999] = 0;
+    TextMessage* Long = PushText(&Messages, 1700000000, 0, 0, Text, 1000);
+    PresenceMessage Presence = {.type = PRESENCE_TYPE_CONNECTED, .author = "alice"};
+    
+    u32 Total = 600;
+    Batch Batch_ = {0};
+    u8* Starts[8];
+    u32 Batches = 0;
+    for (u32 i = 0; i < Total; i++)
+    {
+        HeaderMessage Header = HEADER_INIT((i % 3) ? HEADER_TYPE_TEXT : HEADER_TYPE_PRESENCE);
+        Header.seq = (i % 3) ? 1000 + i : 0;
+        Header.id = 1 + (i * 7) % 5;
+        void* Body = (i % 3) ? (void*)Long : &Presence;
+        if (Header.type == HEADER_TYPE_TEXT)
+            Long->timestamp = 1700000000 - i % 4;
+        
+        u32 Entry = batchEntryMax(&Header, Body);
+        if (!Batch_.at || Batch_.message.size + Entry > BATCH_SIZE)
+        {
+            Expect(Batches < 8);
+            Starts[Batches++] = (u8*)Out.addr + Out.pos;
+            batchBegin(&Batch_, &Out, 0);
+        }
+        batchPush(&Batch_, &Out, &Header, Body);
+    }
+    Expect(Batches > 1);
+    
+    u32 Read = 0;
+    for (u32 b = 0; b < Batches; b++)
+    {
+        HeaderMessage Header;
+        BatchMessage Message;
+        memcpy(&Header, Starts[b], sizeof(Header));
+        memcpy(&Message, Starts[b] + sizeof(Header), sizeof(Message));
+        Expect(Message.size <= BATCH_SIZE);
+        // Only the last one has space left
+        if (b < Batches - 1)
+            Expect(Message.size + batchEntryMax(&(HeaderMessage)HEADER_INIT(HEADER_TYPE_TEXT), Long) > BATCH_SIZE);
+        
+        BatchReader Reader;
+        batchRead(&Reader, &Header, &Message, Starts[b] + sizeof(Header) + sizeof(Message));
+        HeaderMessage* Entry;
+        u32 Count = 0;
+        while ((Entry = batchNext(&Reader, &In)))
+        {
+            u32 i = Read + Count++;
+            Expect(Entry->type == ((i % 3) ? HEADER_TYPE_TEXT : HEADER_TYPE_PRESENCE));
+            Expect(Entry->id == 1 + (i * 7) % 5);
+            if (Entry->type == HEADER_TYPE_TEXT)
+            {
+                Long->timestamp = 1700000000 - i % 4;
+                Expect(Entry->seq == 1000 + i);
+                Expect(EntryCmp(Entry, Entry, Long, Entry->prev));
+            }
+            else
+                Expect(!memcmp(Entry + 1, &Presence, sizeof(Presence)));
+            ArenaReset(&In);
+        }
+        Expect(Count == Message.count);
+        Read += Count;
+    }
+    Expect(Read == Total);
+    
+    ArenaRelease(&Messages);
+    ArenaRelease(&Out);
+    ArenaRelease(&In);
+    return true;
+}
+
+// Advance Wheel one tick at a time up to End and write the tick each timer in Timers expired
+// on to Expired, or -1 if it expired more than once
+void
+AdvanceTimers(TimerWheel* Wheel, u64 End, Timer* Timers, u64* Expired)
+{
+    while (Wheel->now < End)
+    {
+        Timer* Timer_ = TimerAdvance(Wheel, Wheel->now + 1);
+        for (; Timer_; Timer_ = Timer_->next)
+        {
+            u64* Tick = Expired + (Timer_ - Timers);
+            *Tick = (*Tick) ? (u64)-1 : Wheel->now;
+        }
+    }
+}
+
+// Timers on higher levels move down when the level below wraps around and must still expire
+// on their tick, also when they move down more than one level at once
+bool
+TimerCascadeTest(void)
+{
+    TimerWheel Wheel;
+    // Not on a slot boundary so the first cascade comes before a full turn of level 0
+    u64 Start = 100000 + 37;
+    TimerWheelInit(&Wheel, Start);
+    
+    u64 Ticks[] = {
+        1, 26, 27, 63, 64, 65, 100, 4095, 4096, 4097, 4096 + 64 * 5 + 3, 262143, 262144, 300000,
+    };
+    u32 Count = sizeof(Ticks) / sizeof(*Ticks);
+    Timer Timers[sizeof(Ticks) / sizeof(*Ticks)] = {0};
+    u64 Expired[sizeof(Ticks) / sizeof(*Ticks)] = {0};
+    for (u32 i = 0; i < Count; i++)
+        TimerAdd(&Wheel, Timers + i, Start + Ticks[i]);
+    
+    AdvanceTimers(&Wheel, Start + 300001, Timers, Expired);
+    for (u32 i = 0; i < Count; i++)
+        Expect(Expired[i] == Start + Ticks[i]);
+    
+    // Advancing several ticks at once expires the same timers
+    TimerWheelInit(&Wheel, Start);
+    for (u32 i = 0; i < Count; i++)
+        TimerAdd(&Wheel, Timers + i, Start + Ticks[i]);
+    u32 Seen = 0;
+    for (Timer* Timer_ = TimerAdvance(&Wheel, Start + 4096); Timer_; Timer_ = Timer_->next)
+    {
+        Expect(Timer_->expires <= Start + 4096);
+        Seen++;
+    }
+    Expect(Seen == 9);
+    
+    return true;
+}
+
+// A timer that moved down a level can still be removed and moved, also when it shares its slot
+bool
+TimerRemoveTest(void)
+{
+    TimerWheel Wheel;
+    u64 Start = 5000 + 11;
+    TimerWheelInit(&Wheel, Start);
+    
+    Timer Timers[5] = {0};
+    u64 Expired[5] = {0};
+    TimerAdd(&Wheel, Timers + 0, Start + 200);
+    TimerAdd(&Wheel, Timers + 3, Start + 210);
+    // Timers[1] stays in the middle of its slot while they move down together
+    TimerAdd(&Wheel, Timers + 2, Start + 5001);
+    TimerAdd(&Wheel, Timers + 1, Start + 5001);
+    TimerAdd(&Wheel, Timers + 4, Start + 5001);
+    
+    // The first two moved down to level 0 by now
+    AdvanceTimers(&Wheel, Start + 190, Timers, Expired);
+    Expect(Timers[0].prev && Timers[3].prev);
+    TimerRemove(Timers + 0);
+    Expect(!Timers[0].prev && !Timers[0].next);
+    // Moved to before its slot on level 0
+    TimerAdd(&Wheel, Timers + 3, Start + 195);
+    
+    // The other three moved down from level 2 to level 0 by now
+    AdvanceTimers(&Wheel, Start + 4990, Timers, Expired);
+    Expect(!Expired[0]);
+    Expect(Expired[3] == Start + 195);
+    Expect(Timers[1].prev && Timers[2].prev && Timers[4].prev);
+    TimerRemove(Timers + 1);
+    // Removing twice does nothing
+    TimerRemove(Timers + 1);
+    // Whichever followed it is linked to the one before now
+    TimerAdd(&Wheel, Timers + 2, Start + 5400);
+    TimerAdd(&Wheel, Timers + 4, Start + 5500);
+    
+    AdvanceTimers(&Wheel, Start + 6000, Timers, Expired);
+    Expect(!Expired[0] && !Expired[1]);
+    Expect(Expired[2] == Start + 5400 && Expired[4] == Start + 5500);
+    
+    return true;
+}
+
 int
 main(int Argc, char* Argv[])
 {
     test_functions TestFunctions[] = {
         TESTFUNC(DrawingTest),
+        TESTFUNC(BatchRoundTripTest),
+        TESTFUNC(BatchFullTest),
+        TESTFUNC(TimerCascadeTest),
+        TESTFUNC(TimerRemoveTest),
         { 0 }
     };
 